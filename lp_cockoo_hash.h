@@ -1,16 +1,38 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
 #include <limits>
+#include <memory>
+#include <new>
 #include <sstream>
+#include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
-#define LP_COCKOO_HASH_DEBUG 1
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
-#ifdef LP_COCKOO_HASH_DEBUG
-#include <iostream>
-#endif  // LP_COCKOO_HASH_DEBUG
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#if defined(__GNUC__)
+#define LP_COCKOO_HASH_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define LP_COCKOO_HASH_PREFETCH(addr)
+#endif
 
 // Lehman-Panigrahy hash table.
 //
@@ -34,9 +56,13 @@
 //   // BucketWidth is the number of elements in one bucket. Typically 2 to 4.
 //   static constexpr int BucketWidth = 2;
 //
-//   // Alloc is called to allocate an default-initialized array of "V"
+//   // Alloc is called to allocate an default-initialized array of "V".
+//   // All the tables share one array of NumHashes * slots_per_table()
+//   // slots. The constructor and insert throw std::bad_alloc if that does
+//   // not fit in an int.
 //   Value* Alloc(int n) { return new Value[n](); }
 //   // Free is called to free the array allocated by Alloc(n).
+//   // LpCockooHashHugePageAlloc implements both with huge pages.
 //   void Free(Value* array, int n) { delete[] array; }
 //
 //   // Hash computes the Nth hash function (0 <= N < NumHashes).
@@ -50,6 +76,14 @@
 //   //
 //   // Invariant: After the Clear call, Empty(*v) must return false.
 //   void Init(int n, size_t hash, Key k, Value* v) { v->key = k; }
+//   // try_emplace(k, args...) and insert_or_assign(k, args...) call Init
+//   // with their extra arguments, forwarded, so that the value is built in
+//   // the slot. insert_or_assign also calls it on the slot of an existing
+//   // element, whose value it must then replace.
+//   void Init(int n, size_t hash, Key k, Value* v, std::string&& value) {
+//     v->key = k;
+//     v->value = std::move(value);
+//   }
 //
 //   // Equals should check if "v" has key "k". "hash" is a performance hint.
 //   bool Equals(size_t hash, Key k, const Value& v) const { return k == v.key;
@@ -60,19 +94,523 @@
 //   // Clear is called when "v" no longer stores a value.
 //   //
 //   // Invariant: After the Clear call, Empty(*v) must return true.
-//   bool Clear(Value* v) const { return v->key = kEmpty; }
+//   void Clear(Value* v) const { v->key = kEmpty; }
+//
+//   // The following members are optional. The values shown are the defaults
+//   // used when they are omitted.
+//
+//   // AutoResize enables dynamic resizing. When an insert cannot find a slot,
+//   // the tables are doubled and the elements are moved to the new tables
+//   // incrementally, MigrateBatch slots per insert. Growing does not help a
+//   // hash that maps too many keys to the same windows: after 4 resizes in
+//   // a row whose tables cannot take every element, inserts that find no
+//   // slot fail as without AutoResize.
+//   static constexpr bool AutoResize = false;
+//   static constexpr int MigrateBatch = 64;
+//
+//   // StashSize is the number of elements kept in a side array when no slot
+//   // can be vacated for them. find checks the stash only when it is not
+//   // empty.
+//   static constexpr int StashSize = 4;
+//
+//   // TagBits, if 8 or 16, keeps a parallel array of tags derived from the
+//   // hash of each element. Probes compare the tags of a whole window at once
+//   // (with SSE2/AVX2 when available) and touch a Value only on a tag match.
+//   static constexpr int TagBits = 0;
+//
+//   // Concurrent makes find(key, &value) lock-free and lets insert run from
+//   // many threads. Slots are guarded by LockStripes version counters; a
+//   // reader retries if a writer touched any of the windows it read. A writer
+//   // searches for an eviction path without locks, then locks only the
+//   // stripes on the path and validates it before moving elements. Values
+//   // must be trivially copyable, and AutoResize is not supported.
+//   static constexpr bool Concurrent = false;
+//   static constexpr int LockStripes = 4096;
+//
+//   // IndexMode picks how a hash is reduced to a slot index. See
+//   // LpCockooHashIndexMode.
+//   static constexpr LpCockooHashIndexMode IndexMode =
+//       LpCockooHashIndexMode::kModulo;
+//
+//   // Layout picks between overlapping windows and aligned buckets. See
+//   // LpCockooHashLayout.
+//   static constexpr LpCockooHashLayout Layout =
+//       LpCockooHashLayout::kOverlapping;
+//
+//   // All NumHashes tables share one Alloc call. Interleave, which requires
+//   // the aligned layout, stores bucket i of every table next to each other,
+//   // and likewise their tags, so that the windows of a key are close in
+//   // memory when its hashes are correlated.
+//   static constexpr bool Interleave = false;
+//
+//   // PartialKey enables partial-key cuckoo hashing: only Hash(0, ...) is
+//   // called, and the window of an element in each other table is derived
+//   // from its window in table 0 and its tag. An eviction search can then
+//   // find the other windows of an element from its slot and tag alone,
+//   // without reading or hashing its key. It requires TagBits, the aligned
+//   // layout and kPowerOfTwo indexing. With 8-bit tags, an element has only
+//   // 255 possible window offsets, so 16-bit tags reach higher loads in large
+//   // tables. Init and Equals receive Hash(0, k) for every table.
+//   static constexpr bool PartialKey = false;
+//
+//   // StoreHash keeps the hashes of each element for all NumHashes tables
+//   // next to its slot, at a cost of NumHashes * sizeof(size_t) bytes per
+//   // slot. Probes skip slots whose stored hash differs before calling Equals,
+//   // and evictions and resizes read the stored hashes instead of calling
+//   // Hash(n, Value). Worthwhile for keys that are slow to hash or compare,
+//   // such as strings.
+//   static constexpr bool StoreHash = false;
+//
+//   // SingleHash calls only Hash(0, ...) and derives the hash for table i by
+//   // double hashing, Hash(0, k) + i * h2, where h2 is an odd remix of
+//   // Hash(0, k). Each operation then hashes a key once however large
+//   // NumHashes is. Init and Equals receive the derived hashes. PartialKey
+//   // implies it.
+//   static constexpr bool SingleHash = false;
+//
+//   // When every window of a key is full, insert searches for a chain of
+//   // elements to move (see Eviction). The search tries to move the
+//   // elements of at most MaxSearchNodes slots and accepts chains of at
+//   // most MaxSearchDepth moves, so an insert moves at most MaxSearchDepth
+//   // elements. It reads at most BucketWidth * (NumHashes + MaxSearchNodes *
+//   // (NumHashes - 1)) slots with kBfs, and BucketWidth * MaxSearchNodes
+//   // with kRandomWalk. kHybrid runs the BFS and then the walk, each with
+//   // the whole budget, so it reads up to the sum of the two. Lower bounds
+//   // cap the insert latency but send keys to the stash, or trigger a
+//   // resize, at lower loads. The search queue is a fixed-size array in the
+//   // table object (on the stack with Concurrent), so the search never
+//   // allocates.
+//   static constexpr int MaxSearchNodes = 100;
+//   static constexpr int MaxSearchDepth = 100;
+//
+//   // Eviction picks how insert searches for that chain. See
+//   // LpCockooHashEviction.
+//   static constexpr LpCockooHashEviction Eviction =
+//       LpCockooHashEviction::kBfs;
+//
+//   // Trace, if defined, is called on every slot placement and move. See
+//   // LpCockooHashTraceBuffer for a ready-made implementation. When it is
+//   // omitted, tracing compiles to nothing.
+//   void Trace(const LpCockooHashTraceEvent& e);
 // };
 //
+
+// Ways to map a hash to a slot of a table with "buckets" slots.
+enum class LpCockooHashIndexMode {
+  // hash % buckets. Works with any hash, but costs a 64-bit division.
+  kModulo,
+  // (hash * buckets) >> 64 (Lemire's multiply-shift reduction). Uses the
+  // high bits of the hash, so the hash must mix them well.
+  kMultiplyShift,
+  // hash & (buckets - 1), with the tables rounded up to a power of two. Uses
+  // the low bits of the hash, and may use up to twice the memory.
+  kPowerOfTwo,
+};
+
+// Where the BucketWidth-slot windows of a table start.
+enum class LpCockooHashLayout {
+  // At any slot, as in the Lehman-Panigrahy paper. Overlapping windows reach
+  // higher load factors, but a window may straddle two cache lines.
+  kOverlapping,
+  // At multiples of BucketWidth, as in bucketized cuckoo hashing. Windows
+  // are disjoint, and when BucketWidth * sizeof(V) is the cache line size
+  // and Opts::Alloc returns cache-line-aligned memory, a probe touches one
+  // line per table.
+  kAligned,
+};
+
+// How insert finds a chain of elements to move when the windows of a key are
+// full. MaxSearchNodes and MaxSearchDepth bound each of them; kHybrid runs
+// two searches within these bounds.
+enum class LpCockooHashEviction {
+  // Breadth-first search over every slot of each alternate window, as in the
+  // LAKF paper. Finds a shortest chain, but reads many windows to do so.
+  kBfs,
+  // Moves a random element of a random window to a random alternate window
+  // until that window has an empty slot. Reads one window per step, but the
+  // chains are longer and fail more often at high loads.
+  kRandomWalk,
+  // A BFS for chains of at most 2 moves, then a random walk. Most inserts at
+  // moderate loads need no more than that.
+  kHybrid,
+};
+
+// Describes one step taken by insert.
+struct LpCockooHashTraceEvent {
+  enum Type {
+    kInsert,  // A key was stored at (table, index).
+    kStash,   // A key was stored in stash slot "index".
+    kSwap,    // (table, index) and (table2, index2) were swapped.
+    kVacate,  // (table, index) was emptied by an eviction chain.
+  };
+  Type type;
+  int table;
+  size_t index;
+  int table2;
+  size_t index2;
+};
+
+// LpCockooHashTraceBuffer records trace events, e.g., to capture eviction
+// chains in debug builds. Forward Opts::Trace to it:
+//
+//   struct DebugOpts : Opts {
+//     LpCockooHashTraceBuffer* buf;
+//     void Trace(const LpCockooHashTraceEvent& e) { buf->Trace(e); }
+//   };
+class LpCockooHashTraceBuffer {
+ public:
+  void Trace(const LpCockooHashTraceEvent& e) { events_.push_back(e); }
+  const std::vector<LpCockooHashTraceEvent>& events() const { return events_; }
+  void Clear() { events_.clear(); }
+
+  std::string DebugString() const {
+    std::ostringstream m;
+    for (const LpCockooHashTraceEvent& e : events_) {
+      switch (e.type) {
+        case LpCockooHashTraceEvent::kInsert:
+          m << "Insert: " << e.table << ":" << e.index << "\n";
+          break;
+        case LpCockooHashTraceEvent::kStash:
+          m << "Stash: " << e.index << "\n";
+          break;
+        case LpCockooHashTraceEvent::kSwap:
+          m << "Swap: " << e.table << ":" << e.index << "<->" << e.table2
+            << ":" << e.index2 << "\n";
+          break;
+        case LpCockooHashTraceEvent::kVacate:
+          m << "Vacate: " << e.table << ":" << e.index << "\n";
+          break;
+      }
+    }
+    return m.str();
+  }
+
+ private:
+  std::vector<LpCockooHashTraceEvent> events_;
+};
+
+// LpCockooHashHugePageAlloc implements Opts::Alloc and Opts::Free with huge
+// pages, which cut the TLB misses of probes into tables of more than a few
+// MB. Forward to it from Opts:
+//
+//   struct HugeOpts : Opts {
+//     LpCockooHashHugePageAlloc<Value> pages;
+//     Value* Alloc(int n) { return pages.Alloc(n); }
+//     void Free(Value* array, int n) { pages.Free(array, n); }
+//   };
+//
+// Arrays of at least 2MB are mmap'ed with MAP_HUGETLB, with 1GB pages when
+// the array is close to a multiple of 1GB. If the kernel has no such pages
+// reserved, the array is mapped with regular pages, aligned to 2MB, and
+// madvise(MADV_HUGEPAGE) asks for transparent huge pages. Smaller arrays,
+// and all arrays on systems other than Linux, use new[].
+template <typename V>
+class LpCockooHashHugePageAlloc {
+ public:
+  static constexpr size_t kHugePageSize = size_t{2} << 20;
+  static constexpr size_t kGiantPageSize = size_t{1} << 30;
+
+  V* Alloc(int n) {
+    const size_t bytes = MapSize(n);
+    if (bytes == 0) return new V[n]();
+    V* array = static_cast<V*>(Map(bytes));
+    if (array == nullptr) throw std::bad_alloc();
+    for (int i = 0; i < n; i++) new (&array[i]) V();
+    return array;
+  }
+  void Free(V* array, int n) {
+    const size_t bytes = MapSize(n);
+    if (bytes == 0) {
+      delete[] array;
+      return;
+    }
+    for (int i = 0; i < n; i++) array[i].~V();
+#if defined(__linux__)
+    munmap(array, bytes);
+#endif
+  }
+
+ private:
+  // Returns the length of the mapping for "n" elements, or 0 if they are
+  // allocated with new[]. It must not depend on how the mapping was made,
+  // since Free calls it again.
+  static size_t MapSize(int n) {
+#if defined(__linux__)
+    const size_t bytes = n * sizeof(V);
+    if (bytes < kHugePageSize) return 0;
+    const size_t giant = RoundUp(bytes, kGiantPageSize);
+    // Use 1GB pages only if they waste at most 1/8 of the array.
+    if (bytes >= kGiantPageSize && giant - bytes <= bytes / 8) return giant;
+    return RoundUp(bytes, kHugePageSize);
+#else
+    return 0;
+#endif
+  }
+  static size_t RoundUp(size_t n, size_t unit) {
+    return (n + unit - 1) / unit * unit;
+  }
+
+  // Returns a 2MB-aligned mapping of "bytes", or nullptr.
+  static void* Map(size_t bytes) {
+#if defined(__linux__)
+    const int prot = PROT_READ | PROT_WRITE;
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void* p;
+#if defined(MAP_HUGETLB)
+#if defined(MAP_HUGE_1GB)
+    if (bytes % kGiantPageSize == 0) {
+      p = mmap(nullptr, bytes, prot, flags | MAP_HUGETLB | MAP_HUGE_1GB, -1,
+               0);
+      if (p != MAP_FAILED) return p;
+    }
+#endif
+    p = mmap(nullptr, bytes, prot, flags | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) return p;
+#endif
+    // Map an extra huge page and trim both ends so that the mapping is
+    // aligned, which lets transparent huge pages cover all of it.
+    p = mmap(nullptr, bytes + kHugePageSize, prot, flags, -1, 0);
+    if (p == MAP_FAILED) return nullptr;
+    const uintptr_t start = reinterpret_cast<uintptr_t>(p);
+    const uintptr_t aligned = RoundUp(start, kHugePageSize);
+    if (aligned > start) munmap(p, aligned - start);
+    if (aligned < start + kHugePageSize) {
+      munmap(reinterpret_cast<void*>(aligned + bytes),
+             start + kHugePageSize - aligned);
+    }
+    p = reinterpret_cast<void*>(aligned);
+#if defined(MADV_HUGEPAGE)
+    madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+    return p;
+#else
+    return nullptr;
+#endif
+  }
+};
+
+namespace lp_cockoo_hash_internal {
+
+template <typename T>
+struct Void {
+  typedef void type;
+};
+
+// LP_COCKOO_HASH_OPTION(Name, Type, Default) defines OptName<Opts>, whose
+// value is Opts::Name if Opts declares it, or Default otherwise.
+#define LP_COCKOO_HASH_OPTION(Name, Type, Default)                       \
+  template <typename O, typename = void>                                 \
+  struct Opt##Name : std::integral_constant<Type, Default> {};           \
+  template <typename O>                                                  \
+  struct Opt##Name<O, typename Void<decltype(O::Name)>::type>            \
+      : std::integral_constant<Type, O::Name> {};
+
+LP_COCKOO_HASH_OPTION(AutoResize, bool, false)
+LP_COCKOO_HASH_OPTION(MigrateBatch, int, 64)
+LP_COCKOO_HASH_OPTION(StashSize, int, 4)
+LP_COCKOO_HASH_OPTION(TagBits, int, 0)
+LP_COCKOO_HASH_OPTION(Concurrent, bool, false)
+LP_COCKOO_HASH_OPTION(LockStripes, int, 4096)
+LP_COCKOO_HASH_OPTION(IndexMode, LpCockooHashIndexMode,
+                      LpCockooHashIndexMode::kModulo)
+LP_COCKOO_HASH_OPTION(Layout, LpCockooHashLayout,
+                      LpCockooHashLayout::kOverlapping)
+LP_COCKOO_HASH_OPTION(Interleave, bool, false)
+LP_COCKOO_HASH_OPTION(PartialKey, bool, false)
+LP_COCKOO_HASH_OPTION(StoreHash, bool, false)
+LP_COCKOO_HASH_OPTION(SingleHash, bool, false)
+LP_COCKOO_HASH_OPTION(MaxSearchNodes, int, 100)
+LP_COCKOO_HASH_OPTION(MaxSearchDepth, int, 100)
+LP_COCKOO_HASH_OPTION(Eviction, LpCockooHashEviction,
+                      LpCockooHashEviction::kBfs)
+
+// Returns the high half of the 128-bit product a * b.
+inline uint64_t MulHi64(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+  return static_cast<uint64_t>((static_cast<unsigned __int128>(a) * b) >> 64);
+#else
+  const uint64_t a_lo = a & 0xffffffff, a_hi = a >> 32;
+  const uint64_t b_lo = b & 0xffffffff, b_hi = b >> 32;
+  const uint64_t mid1 = a_hi * b_lo + ((a_lo * b_lo) >> 32);
+  const uint64_t mid2 = a_lo * b_hi + (mid1 & 0xffffffff);
+  return a_hi * b_hi + (mid1 >> 32) + (mid2 >> 32);
+#endif
+}
+
+// A bijective mix of "x", used to derive a second hash from the first one.
+inline uint64_t Remix(uint64_t x) {
+  x ^= x >> 32;
+  x *= 0xd6e8feb86659fd93ULL;
+  x ^= x >> 32;
+  return x;
+}
+
+inline size_t RoundUpToPowerOfTwo(size_t n) {
+  size_t p = 1;
+  while (p < n) p *= 2;
+  return p;
+}
+
+inline int CountTrailingZeros(uint32_t x) {
+#if defined(__GNUC__)
+  return __builtin_ctz(x);
+#else
+  int n = 0;
+  for (; (x & 1) == 0; x >>= 1) n++;
+  return n;
+#endif
+}
+
+constexpr uint32_t WidthMask(int width) {
+  return width >= 32 ? ~0u : (1u << width) - 1;
+}
+
+// Returns a bitmask of the positions in tags[0, Width) that are equal to
+// "tag". "tags" must be readable for 32 bytes.
+template <int Width>
+inline uint32_t MatchTags(const uint8_t* tags, uint8_t tag) {
+#if defined(__SSE2__)
+  if (Width <= 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tags));
+    const __m128i eq = _mm_cmpeq_epi8(v, _mm_set1_epi8(tag));
+    return _mm_movemask_epi8(eq) & WidthMask(Width);
+  }
+#endif
+#if defined(__AVX2__)
+  if (Width <= 32) {
+    const __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tags));
+    const __m256i eq = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(tag));
+    return _mm256_movemask_epi8(eq) & WidthMask(Width);
+  }
+#endif
+  uint32_t mask = 0;
+  for (int i = 0; i < Width; i++) mask |= uint32_t{tags[i] == tag} << i;
+  return mask;
+}
+
+template <int Width>
+inline uint32_t MatchTags(const uint16_t* tags, uint16_t tag) {
+#if defined(__SSE2__)
+  if (Width <= 8) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tags));
+    const __m128i eq = _mm_cmpeq_epi16(v, _mm_set1_epi16(tag));
+    return _mm_movemask_epi8(_mm_packs_epi16(eq, eq)) & WidthMask(Width);
+  }
+#endif
+  uint32_t mask = 0;
+  for (int i = 0; i < Width; i++) mask |= uint32_t{tags[i] == tag} << i;
+  return mask;
+}
+
+// A vector of at most Capacity elements stored inline, so that it never
+// allocates.
+template <typename T, size_t Capacity>
+class InlineVector {
+ public:
+  void push_back(const T& v) {
+    assert(size_ < Capacity);
+    elems_[size_++] = v;
+  }
+  void clear() { size_ = 0; }
+  // Drops the elements at [n, size()).
+  void truncate(size_t n) { size_ = n; }
+  size_t size() const { return size_; }
+  T& operator[](size_t i) { return elems_[i]; }
+  const T& operator[](size_t i) const { return elems_[i]; }
+  const T& back() const { return elems_[size_ - 1]; }
+  T* begin() { return elems_.data(); }
+  T* end() { return elems_.data() + size_; }
+  const T* begin() const { return elems_.data(); }
+  const T* end() const { return elems_.data() + size_; }
+
+ private:
+  std::array<T, Capacity> elems_;
+  size_t size_ = 0;
+};
+
+// HasTrace<Opts>::value is true if Opts defines Trace().
+template <typename O, typename = void>
+struct HasTrace : std::false_type {};
+template <typename O>
+struct HasTrace<O, typename Void<decltype(std::declval<O&>().Trace(
+                       std::declval<const LpCockooHashTraceEvent&>()))>::type>
+    : std::true_type {};
+
+}  // namespace lp_cockoo_hash_internal
+
 template <typename K, typename V, typename Opts>
 class LpCockooHash {
  public:
   static constexpr int NumHashes = Opts::NumHashes;
   static constexpr int BucketWidth = Opts::BucketWidth;
+  static constexpr bool AutoResize =
+      lp_cockoo_hash_internal::OptAutoResize<Opts>::value;
+  static constexpr int MigrateBatch =
+      lp_cockoo_hash_internal::OptMigrateBatch<Opts>::value;
+  static constexpr int StashSize =
+      lp_cockoo_hash_internal::OptStashSize<Opts>::value;
+  static constexpr int TagBits =
+      lp_cockoo_hash_internal::OptTagBits<Opts>::value;
+  static_assert(TagBits == 0 || TagBits == 8 || TagBits == 16,
+                "TagBits must be 0, 8 or 16");
+  static_assert(TagBits == 0 || BucketWidth <= 32,
+                "Tags support BucketWidth up to 32");
+  static constexpr bool Concurrent =
+      lp_cockoo_hash_internal::OptConcurrent<Opts>::value;
+  static constexpr int LockStripes =
+      lp_cockoo_hash_internal::OptLockStripes<Opts>::value;
+  static constexpr LpCockooHashIndexMode IndexMode =
+      lp_cockoo_hash_internal::OptIndexMode<Opts>::value;
+  static constexpr LpCockooHashLayout Layout =
+      lp_cockoo_hash_internal::OptLayout<Opts>::value;
+  static constexpr bool Interleave =
+      lp_cockoo_hash_internal::OptInterleave<Opts>::value;
+  static_assert(!Interleave || Layout == LpCockooHashLayout::kAligned,
+                "Interleave requires the aligned layout");
+  static constexpr bool PartialKey =
+      lp_cockoo_hash_internal::OptPartialKey<Opts>::value;
+  static_assert(!PartialKey ||
+                    (TagBits > 0 && Layout == LpCockooHashLayout::kAligned &&
+                     IndexMode == LpCockooHashIndexMode::kPowerOfTwo),
+                "PartialKey requires TagBits, the aligned layout and "
+                "kPowerOfTwo indexing");
+  static constexpr bool StoreHash =
+      lp_cockoo_hash_internal::OptStoreHash<Opts>::value;
+  static constexpr bool SingleHash =
+      lp_cockoo_hash_internal::OptSingleHash<Opts>::value;
+  static constexpr int MaxSearchNodes =
+      lp_cockoo_hash_internal::OptMaxSearchNodes<Opts>::value;
+  static constexpr int MaxSearchDepth =
+      lp_cockoo_hash_internal::OptMaxSearchDepth<Opts>::value;
+  static_assert(MaxSearchNodes >= 0 && MaxSearchDepth >= 1,
+                "MaxSearchNodes must be non-negative and MaxSearchDepth "
+                "positive");
+  static constexpr LpCockooHashEviction Eviction =
+      lp_cockoo_hash_internal::OptEviction<Opts>::value;
+  static_assert(!Concurrent || !AutoResize,
+                "Concurrent tables cannot be resized");
+  static_assert(!Concurrent || std::is_trivially_copyable<V>::value,
+                "Concurrent readers copy Values that may be torn");
   static constexpr size_t kNoParent = std::numeric_limits<size_t>::max();
   static constexpr double LoadFactor = 0.9;
   using HashValue = size_t;  // Return value of hash functions.
 
+  // An iterator refers to a slot in one of the tables. Tables
+  // [0, NumHashes) are the current tables. Tables [NumHashes, 2*NumHashes)
+  // are the tables being drained by a resize. Table 2*NumHashes is the
+  // stash.
+  //
+  // Incrementing an iterator moves it to the next element in that order.
+  // With TagBits, the scan compares a vector of tags at a time against the
+  // empty tag, so it reads a Value only for occupied slots.
   struct iterator {
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = V;
+    using difference_type = std::ptrdiff_t;
+    using pointer = V*;
+    using reference = V&;
+
     const LpCockooHash* parent;
     int table;
     size_t index;
@@ -81,188 +619,1589 @@ class LpCockooHash {
       return i2.table == table && i2.index == index;
     }
     bool operator!=(const iterator i2) const { return !(*this == i2); }
-    V& operator*() { return parent->tables_[table][index]; }
-    V* operator->() { return &parent->tables_[table][index]; }
+    V& operator*() { return *parent->SlotAt(table, index); }
+    V* operator->() { return parent->SlotAt(table, index); }
+    iterator& operator++() {
+      *this = parent->NextElem(table, index + 1);
+      return *this;
+    }
+    iterator operator++(int) {
+      iterator it = *this;
+      ++*this;
+      return it;
+    }
   };
 
-  // "elems" is the max number of elems that will be stored in the table.  The
-  // hashtable hehavior is undefined if you try to store more that "elems"
-  // elements.
-  //
-  // TODO(saito) Implement dynamic resizing.
+  // Slots [begin, end) of one table, numbered as in iterator. Ranges split a
+  // scan into disjoint parts that threads, e.g., of a work-stealing
+  // executor, can scan in parallel. Like iterators, they are invalidated by
+  // inserts.
+  struct range {
+    const LpCockooHash* parent;
+    int table;
+    size_t begin;
+    size_t end;
+
+    // Calls fn(V&) for every element in the range.
+    template <typename Fn>
+    void for_each(Fn&& fn) const {
+      parent->ForEachIn(*this, fn);
+    }
+    // Moves the second half of the range to "second", split at the first
+    // slot past the middle that starts a cache line (see ranges()). Returns
+    // false if there is no such slot.
+    bool split(range* second) {
+      const size_t mid =
+          parent->LineBoundary(table, begin + (end - begin + 1) / 2, end);
+      if (mid >= end) return false;
+      *second = range{parent, table, mid, end};
+      end = mid;
+      return true;
+    }
+  };
+
+  // "elems" is the max number of elems that will be stored in the table.
+  // Unless Opts::AutoResize is set, the hashtable hehavior is undefined if you
+  // try to store more that "elems" elements. With AutoResize, "elems" is just
+  // the initial capacity.
   LpCockooHash(size_t elems, Opts opts = Opts()) : opts_(std::move(opts)) {
-    buckets_per_table_ = (elems / LoadFactor - 1) / NumHashes + 1;
-    for (int i = 0; i < tables_.size(); i++) {
-      tables_[i] = opts_.Alloc(buckets_per_table_);
+    AllocTables(BucketsFor(elems), &tables_);
+    old_tables_ = Tables();
+    if (StashSize > 0) stash_ = opts_.Alloc(StashSize);
+    if (Concurrent) {
+      stripes_.reset(new std::atomic<uint64_t>[LockStripes + 1]());
     }
   }
 
   ~LpCockooHash() {
-    for (int i = 0; i < tables_.size(); i++) {
-      opts_.Free(tables_[i], buckets_per_table_);
-    }
+    FreeTables(&tables_);
+    if (resizing()) FreeTables(&old_tables_);
+    if (StashSize > 0) opts_.Free(stash_, StashSize);
   }
 
-  iterator begin() const { return iterator{this, 0, 0}; }
-  iterator end() const { return iterator{this, NumHashes, 0}; }
+  // Iterates over all elements. Erasing the element under an iterator does
+  // not invalidate it, but inserts do.
+  iterator begin() const { return NextElem(0, 0); }
+  iterator end() const { return iterator{this, kEndTable, 0}; }
+  // Both finds probe the tables in order and compute the hash for table
+  // hi + 1 only after table hi misses, so a key found in table 0 costs one
+  // call to Opts::Hash. Inserts fill table 0 first to make that the common
+  // case.
   iterator find(const K& key) const;
+  // Copies the value for "key" to "value". Returns false if "key" is not
+  // found. With Opts::Concurrent, this is the lookup that may run while other
+  // threads insert or erase; it never blocks writers.
+  bool find(const K& key, V* value) const;
+  // Looks up keys[0..n) and stores the results in out[0..n). Equivalent to
+  // calling find for each key, but it hashes a group of keys and prefetches
+  // all their windows before probing any of them, so that the cache misses
+  // overlap.
+  void find_batch(const K* keys, size_t n, iterator* out) const;
   void erase(iterator iter);
-  std::pair<iterator, bool> insert(const K& key);
+  // Erases "key". Returns the number of elements erased, 0 or 1.
+  size_t erase(const K& key);
+  // Erases every element for which pred(const V&) returns true, in one
+  // sequential sweep over the tables. Returns the number of elements erased.
+  // With Opts::Concurrent, pred sees a copy of each element that no writer
+  // modified while it was read, and is called again on the element with its
+  // stripe locked before erasing it. An element that an insert moves during
+  // the sweep may be missed.
+  template <typename Pred>
+  size_t erase_if(Pred pred);
+  // Inserts and erases invalidate all iterators. With Opts::Concurrent, they
+  // may run concurrently with find(key, &value), but iterators must not be
+  // used while another thread modifies the table.
+  //
+  // Returns {iterator to the new element, true} on success, and {iterator to
+  // the existing element, false} if "key" is already in the table. Returns
+  // {end(), false} if the table is full, which with AutoResize happens only
+  // when resizing stops making room (see Opts::AutoResize).
+  std::pair<iterator, bool> insert(const K& key) { return Emplace<false>(key); }
+  // Like insert, but a new element is initialized with
+  // Opts::Init(n, hash, key, v, args...). "args" are not used if "key" is
+  // already in the table.
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(const K& key, Args&&... args) {
+    return Emplace<false>(key, std::forward<Args>(args)...);
+  }
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(K&& key, Args&&... args) {
+    return Emplace<false>(std::move(key), std::forward<Args>(args)...);
+  }
+  // Like try_emplace, but if "key" is already in the table, its element is
+  // passed to Opts::Init(n, hash, key, v, args...) too.
+  template <typename... Args>
+  std::pair<iterator, bool> insert_or_assign(const K& key, Args&&... args) {
+    return Emplace<true>(key, std::forward<Args>(args)...);
+  }
+  template <typename... Args>
+  std::pair<iterator, bool> insert_or_assign(K&& key, Args&&... args) {
+    return Emplace<true>(std::move(key), std::forward<Args>(args)...);
+  }
+
+  // Returns ranges that cover all slots, each about "max_slots" slots of one
+  // table. The stash is one more range. Ranges, and the halves made by
+  // range::split, end at slots that start a cache line, so threads that scan
+  // neighbouring ranges of one table do not share lines. This does not hold
+  // across tables: the first range of a table may share a line with the last
+  // one of the previous table. With Opts::Interleave, the buckets of all
+  // tables alternate in memory, so table ranges end at arbitrary slots and
+  // do share lines.
+  std::vector<range> ranges(size_t max_slots) const;
+  // Calls fn(V&) for every element, from "num_threads" threads including the
+  // caller. "fn" must be safe to call concurrently, and the table must not
+  // be modified until this returns.
+  template <typename Fn>
+  void parallel_for_each(Fn fn, int num_threads) const;
+
+  // Number of positions at which a window can start in each of the current
+  // tables.
+  size_t buckets_per_table() const { return tables_.buckets; }
+  // Number of slots in each of the current tables. This is
+  // buckets_per_table() + BucketWidth - 1 with overlapping windows, and
+  // buckets_per_table() * BucketWidth with aligned ones.
+  size_t slots_per_table() const { return SlotCount(tables_); }
+  // Number of inserts that stored their key after moving "moves" elements,
+  // 0 <= moves <= MaxSearchDepth. Inserts into the stash are not counted.
+  uint64_t inserts_with_moves(int moves) const {
+    uint64_t n = 0;
+    for (int s = 0; s < kCountShards; s++) {
+      n += LoadCount(move_counts_[s * kCountStride + moves]);
+    }
+    return n;
+  }
+  // Returns true while elements are being moved to resized tables.
+  bool resizing() const { return old_tables_.buckets != 0; }
+
+  // Starts moving all elements into tables sized, as the constructor would
+  // size them, for twice the current # of elements, and frees the current
+  // tables through Opts::Free once they are drained. The headroom keeps
+  // most elements in table 0, where a hit takes one probe; tables sized for
+  // exactly the count hold only about half of them there. Like AutoResize
+  // growth, the move is incremental: each insert moves MigrateBatch slots,
+  // and migrate() moves more, e.g., while the table is idle. Lookups see
+  // elements in both the old and the new tables meanwhile. With
+  // Opts::Concurrent, readers do not look at old tables, so the move is done
+  // at once and must not run concurrently with any other operation.
+  void shrink_to_fit();
+  // Synchronously moves all elements into tables sized for
+  // max("elems", # of elements), as the constructor would size them.
+  void rehash(size_t elems);
+  // Moves up to "slots" slots of an in-flight resize to the new tables.
+  void migrate(size_t slots) {
+    if (resizing()) Migrate(slots);
+  }
+  // Number of elements in the stash.
+  int stash_size() const { return stash_size_; }
 
  private:
+  static constexpr int kStashTable = 2 * NumHashes;
+  // Min slots per range of parallel_for_each.
+  static constexpr size_t kMinParallelChunk = 4096;
+  static constexpr int kEndTable = kStashTable + 1;
+  // # of keys hashed and prefetched together by find_batch.
+  static constexpr size_t kFindBatch = 32;
+
+  // Tag 0 marks an empty slot.
+  using Tag = typename std::conditional<TagBits == 16, uint16_t, uint8_t>::type;
+  // Tags past the last slot of a table, to pad SIMD loads.
+  static constexpr size_t kTagPadding = 32 / sizeof(Tag);
+
+  // A set of NumHashes tables of the same size. With overlapping windows, a
+  // window may start at any of the first "buckets" slots, and each table has
+  // BucketWidth - 1 more slots so that the last windows do not wrap around.
+  // Every window is thus one contiguous span. With aligned windows, the
+  // tables are "buckets" windows laid end to end.
+  //
+  // All the tables are carved out of one Alloc'ed array, and so are the tag
+  // arrays. Use SlotIn to address a slot.
+  struct Tables {
+    // Start of each table. slots[0] is the allocated array.
+    std::array<V*, NumHashes> slots;
+    std::array<Tag*, NumHashes> tags;  // Used only if TagBits > 0.
+    // Hashes of the element in *SlotIn(hi, index) are at
+    // hashes[SlotIn(hi, index) - slots[0]]. Used only if StoreHash.
+    std::array<HashValue, NumHashes>* hashes;
+    size_t buckets;  // # of window starts per table.
+  };
+
   struct Coord {
     size_t id;
     size_t parent;
     int table;
     size_t index;
+    // Hash, for "table", of the element that moves into this slot.
+    HashValue hash;
   };
+  // A BFS expands at most MaxSearchNodes slots after the NumHashes windows
+  // it starts from.
+  using SearchQueue = lp_cockoo_hash_internal::InlineVector<
+      Coord, BucketWidth * (NumHashes + static_cast<size_t>(MaxSearchNodes) *
+                                            (NumHashes - 1))>;
+  // The empty slot followed by at most MaxSearchDepth elements to move.
+  using Chain =
+      lp_cockoo_hash_internal::InlineVector<Coord, MaxSearchDepth + 1>;
+
+  // Returns Tables::buckets for tables of at least "slots" slots each.
+  static size_t TableSize(size_t slots) {
+    const size_t buckets = Layout == LpCockooHashLayout::kAligned
+                               ? (slots - 1) / BucketWidth + 1
+                               : slots;
+    return IndexMode == LpCockooHashIndexMode::kPowerOfTwo
+               ? lp_cockoo_hash_internal::RoundUpToPowerOfTwo(buckets)
+               : buckets;
+  }
+  // Maps "hash" to [0, buckets).
+  static size_t Reduce(HashValue hash, size_t buckets) {
+    switch (IndexMode) {
+      case LpCockooHashIndexMode::kMultiplyShift:
+        return sizeof(HashValue) == 8
+                   ? lp_cockoo_hash_internal::MulHi64(hash, buckets)
+                   : (uint64_t{hash} * buckets) >> 32;
+      case LpCockooHashIndexMode::kPowerOfTwo:
+        return hash & (buckets - 1);
+      default:
+        return hash % buckets;
+    }
+  }
+  // Returns the first slot of the window in table "hi" of "t" for an
+  // element whose hash for that table is "hash".
+  static size_t IndexOf(const Tables& t, int hi, HashValue hash) {
+    if (PartialKey) {
+      return (Reduce(hash, t.buckets) ^ TagOffset(t, hi, TagOf(hash))) *
+             BucketWidth;
+    }
+    const size_t bucket = Reduce(hash, t.buckets);
+    return Layout == LpCockooHashLayout::kAligned ? bucket * BucketWidth
+                                                  : bucket;
+  }
+  // With PartialKey, the bucket of an element in table "hi" is its bucket
+  // in table 0 XOR TagOffset(hi, its tag).
+  static size_t TagOffset(const Tables& t, int hi, Tag tag) {
+    if (hi == 0) return 0;
+    return ((uint64_t{tag} * NumHashes + hi) * 0xc6a4a7935bd1e995ULL >> 20) &
+           (t.buckets - 1);
+  }
+  // True if only Hash(0, ...) is called.
+  static constexpr bool kDerivedHashes = PartialKey || SingleHash;
+  // Returns the hash for table "hi" given the one for table 0.
+  static HashValue DeriveHash(HashValue hash0, int hi) {
+    if (PartialKey) return hash0;
+    return hash0 + hi * static_cast<HashValue>(
+                            lp_cockoo_hash_internal::Remix(hash0) | 1);
+  }
+  // Returns the hash of "key" for table "hi". "hashes" must hold the hashes
+  // for tables [0, hi).
+  HashValue HashFor(int hi, const K& key,
+                    const std::array<HashValue, NumHashes>& hashes) const {
+    return kDerivedHashes && hi > 0 ? DeriveHash(hashes[0], hi)
+                                    : opts_.Hash(hi, key);
+  }
+  // Same as HashFor, for an element.
+  HashValue ElemHashFor(int hi, const V& elem,
+                        const std::array<HashValue, NumHashes>& hashes) {
+    return kDerivedHashes && hi > 0 ? DeriveHash(hashes[0], hi)
+                                    : opts_.Hash(hi, elem);
+  }
+  // Returns the first slot of the window in table "hi2" of the element at
+  // slot "index" of current table "hi". Used only with PartialKey.
+  size_t AltIndex(int hi, size_t index, int hi2) const {
+    const Tag tag = *TagIn(tables_, hi, index);
+    const size_t bucket0 = index / BucketWidth ^ TagOffset(tables_, hi, tag);
+    return (bucket0 ^ TagOffset(tables_, hi2, tag)) * BucketWidth;
+  }
+  // Returns the last slot of the window that starts at slot "ti".
+  static size_t WindowLast(const Tables& t, size_t ti) {
+    return ti + BucketWidth - 1;
+  }
+  // Returns the # of slots in each table of "t".
+  static size_t SlotCount(const Tables& t) {
+    return Layout == LpCockooHashLayout::kAligned
+               ? t.buckets * BucketWidth
+               : t.buckets + BucketWidth - 1;
+  }
 
-  Coord EvictChain(Coord tail, const std::vector<Coord>& queue);
-  V* MutableSlot(Coord c) { return &tables_[c.table][c.index]; }
+  // Returns slot "index" of table "hi" of "t".
+  static V* SlotIn(const Tables& t, int hi, size_t index) {
+    if (!Interleave) return t.slots[hi] + index;
+    // Buckets of all tables alternate: bucket b of table hi is the
+    // (b * NumHashes + hi)th bucket of the array.
+    return t.slots[hi] + (index / BucketWidth) * NumHashes * BucketWidth +
+           index % BucketWidth;
+  }
+  // Returns the tag of slot "index" of table "hi" of "t". Tags are
+  // interleaved like the slots, so the tags of a window are contiguous.
+  static Tag* TagIn(const Tables& t, int hi, size_t index) {
+    if (!Interleave) return t.tags[hi] + index;
+    return t.tags[hi] + (index / BucketWidth) * NumHashes * BucketWidth +
+           index % BucketWidth;
+  }
 
-  const V& Slot(Coord c) const { return tables_[c.table][c.index]; }
-  std::string CoordDebugString(Coord c) const {
-    std::ostringstream m;
-    m << Slot(c).DebugString() << "(id:" << c.id << " parent:";
-    if (c.parent == kNoParent) {
-      m << "-";
-    } else {
-      m << c.parent;
+  // Returns the # of slots in the array that holds all tables of "t", which
+  // Opts::Alloc takes as an int. Throws std::bad_alloc if it does not fit.
+  static int ArraySlots(const Tables& t) {
+    const size_t n = NumHashes * SlotCount(t);
+    if (n > static_cast<size_t>(std::numeric_limits<int>::max())) {
+      throw std::bad_alloc();
     }
-    m << " table:" << c.table << " index:" << c.index << ")";
-    return m.str();
+    return static_cast<int>(n);
   }
 
-  size_t buckets_per_table_;
-  std::array<V*, NumHashes> tables_;
+  void AllocTables(size_t buckets, Tables* t) {
+    t->buckets = buckets;
+    const size_t slots = SlotCount(*t);
+    V* array = opts_.Alloc(ArraySlots(*t));
+    // The tag loads may read kTagPadding tags past the end of a table.
+    // Interleaved tables end together, so they share one padding.
+    Tag* tags = nullptr;
+    if (TagBits > 0) {
+      tags = Interleave ? new Tag[NumHashes * slots + kTagPadding]()
+                        : new Tag[NumHashes * (slots + kTagPadding)]();
+    }
+    for (int i = 0; i < NumHashes; i++) {
+      t->slots[i] = array + i * (Interleave ? BucketWidth : slots);
+      t->tags[i] = TagBits > 0 ? tags + i * (Interleave ? BucketWidth
+                                                      : slots + kTagPadding)
+                               : nullptr;
+    }
+    t->hashes = StoreHash
+                    ? new std::array<HashValue, NumHashes>[NumHashes * slots]()
+                    : nullptr;
+  }
+  void FreeTables(Tables* t) {
+    opts_.Free(t->slots[0], ArraySlots(*t));
+    if (TagBits > 0) delete[] t->tags[0];
+    if (StoreHash) delete[] t->hashes;
+    t->buckets = 0;
+  }
+  // Returns the stored hashes of slot "index" of table "hi" of "t".
+  static std::array<HashValue, NumHashes>* HashesIn(const Tables& t, int hi,
+                                                    size_t index) {
+    return &t.hashes[SlotIn(t, hi, index) - t.slots[0]];
+  }
+  // Checks if slot "index" of table "hi" of "t" holds "key", whose hash for
+  // the table is "hash".
+  bool SlotHasKey(const Tables& t, int hi, size_t index, HashValue hash,
+                  const K& key) const {
+    if (StoreHash && (*HashesIn(t, hi, index))[hi] != hash) return false;
+    return opts_.Equals(hash, key, *SlotIn(t, hi, index));
+  }
+
+  static Tag TagOf(HashValue hash) {
+    // Mix the hash since Opts::Hash often keeps its entropy in the low bits
+    // that also pick the slot.
+    const Tag tag = static_cast<Tag>((hash * 0x9e3779b97f4a7c15ULL) >>
+                                     (8 * (sizeof(HashValue) - sizeof(Tag))));
+    return tag == 0 ? 1 : tag;
+  }
+  static void SetTag(Tables* t, int hi, size_t index, Tag tag) {
+    if (TagBits == 0) return;
+    *TagIn(*t, hi, index) = tag;
+  }
+
+  // The slot stripe numbers; stripe LockStripes guards the stash.
+  static constexpr size_t kStashStripe = LockStripes;
+
+  // Returns the stripe that guards slot "index" of table "hi". A window spans
+  // at most two stripes.
+  static size_t StripeOf(int hi, size_t index) {
+    return ((index / BucketWidth) * NumHashes + hi) % LockStripes;
+  }
+
+  // Writers make the version of a stripe odd while they modify it.
+  void LockStripe(size_t stripe) {
+    if (!Concurrent) return;
+    std::atomic<uint64_t>& v = stripes_[stripe];
+    uint64_t cur = v.load(std::memory_order_relaxed);
+    for (;;) {
+      if ((cur & 1) == 0 &&
+          v.compare_exchange_weak(cur, cur + 1, std::memory_order_acquire)) {
+        break;
+      }
+      cur = v.load(std::memory_order_relaxed);
+    }
+    // Orders the version bump before the slot stores.
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+  void UnlockStripe(size_t stripe) {
+    if (!Concurrent) return;
+    stripes_[stripe].fetch_add(1, std::memory_order_release);
+  }
+  // Returns the version of "stripe" once no writer holds it.
+  uint64_t ReadStripe(size_t stripe) const {
+    uint64_t v;
+    while ((v = stripes_[stripe].load(std::memory_order_acquire)) & 1) {
+    }
+    return v;
+  }
+  // The stripes a writer locks: two per window, the stash, and the slots of
+  // an eviction chain.
+  using StripeList = lp_cockoo_hash_internal::InlineVector<
+      size_t, 2 * NumHashes + MaxSearchDepth + 2>;
+  // Sorts and dedups "stripes", then locks them in that order. The global
+  // order keeps writers that lock overlapping sets from deadlocking.
+  void LockAll(StripeList* stripes) {
+    std::sort(stripes->begin(), stripes->end());
+    stripes->truncate(std::unique(stripes->begin(), stripes->end()) -
+                      stripes->begin());
+    for (size_t stripe : *stripes) LockStripe(stripe);
+  }
+  void UnlockAll(const StripeList& stripes) {
+    for (size_t stripe : stripes) UnlockStripe(stripe);
+  }
+  // Checks that stripes[begin, end) still have the given versions.
+  template <size_t N>
+  bool ValidVersions(const std::array<size_t, N>& stripes,
+                     const std::array<uint64_t, N>& versions, size_t begin,
+                     size_t end) const {
+    bool valid = true;
+    for (size_t i = begin; i < end; i++) {
+      valid &= stripes_[stripes[i]].load(std::memory_order_relaxed) ==
+               versions[i];
+    }
+    return valid;
+  }
+  // Appends the stripes of the windows for "hashes" and of the stash.
+  void AddWindowStripes(const std::array<HashValue, NumHashes>& hashes,
+                        StripeList* stripes) const {
+    for (int hi = 0; hi < NumHashes; hi++) {
+      const size_t ti = IndexOf(tables_, hi, hashes[hi]);
+      stripes->push_back(StripeOf(hi, ti));
+      stripes->push_back(StripeOf(hi, WindowLast(tables_, ti)));
+    }
+    stripes->push_back(kStashStripe);
+  }
+
+  // Looks for "key" in the window of table "hi" of "t" that starts at "hash".
+  bool ProbeWindow(const Tables& t, int hi, HashValue hash, const K& key,
+                   size_t* index) const;
+  void PrefetchWindow(int hi, HashValue hash) const {
+    const size_t ti = IndexOf(tables_, hi, hash);
+    if (TagBits > 0) LP_COCKOO_HASH_PREFETCH(TagIn(tables_, hi, ti));
+    LP_COCKOO_HASH_PREFETCH(SlotIn(tables_, hi, ti));
+    LP_COCKOO_HASH_PREFETCH(SlotIn(tables_, hi, WindowLast(tables_, ti)));
+  }
+  // Finds an empty slot in the window of current table "hi" that starts at
+  // "hash".
+  bool FindEmptyInWindow(int hi, HashValue hash, size_t* index) const;
+  // Looks for "key" in the old tables and the stash.
+  iterator FindOverflow(const K& key,
+                        const std::array<HashValue, NumHashes>& hashes) const;
+  // Finds an empty slot in the windows of the current tables for an element
+  // with the given hashes.
+  bool FindEmptySlot(const std::array<HashValue, NumHashes>& hashes,
+                     Coord* slot) const;
+  // Vacates a slot in the windows for "hashes" by moving existing elements
+  // to their alternate locations. Returns false if no such chain is found.
+  bool EvictSlot(const std::array<HashValue, NumHashes>& hashes, Coord* slot);
+  // Searches from the windows for "hashes" to an empty slot, as Eviction
+  // says. On success, "chain" holds the path from the empty slot back to a
+  // window slot.
+  bool FindEvictionPath(const std::array<HashValue, NumHashes>& hashes,
+                        SearchQueue* queue, Chain* chain);
+  // FindEvictionPath with a BFS for chains of at most "max_depth" moves.
+  bool FindBfsPath(const std::array<HashValue, NumHashes>& hashes,
+                   int max_depth, SearchQueue* queue, Chain* chain);
+  // Returns a new number for each random walk. Concurrent inserts count
+  // their walks per thread, starting from the thread id, so they share no
+  // state.
+  uint64_t NextWalk() {
+    if (!Concurrent) return ++walks_;
+    static thread_local uint64_t walks =
+        std::hash<std::thread::id>()(std::this_thread::get_id());
+    return ++walks;
+  }
+  // FindEvictionPath with a random walk.
+  bool FindRandomWalkPath(const std::array<HashValue, NumHashes>& hashes,
+                          Chain* chain);
+  // Max moves of the chains that the BFS of kHybrid looks for.
+  static constexpr int kHybridBfsDepth =
+      MaxSearchDepth < 2 ? MaxSearchDepth : 2;
+  // Returns the start of the window, in table "hi", of the element at
+  // current slot "c". Sets "hash" to the element's hash for "hi", except
+  // with PartialKey, which does not need it.
+  size_t AltWindow(Coord c, int hi, HashValue* hash) {
+    if (PartialKey) return AltIndex(c.table, c.index, hi);
+    *hash = StoredOrComputedHash(c, hi);
+    return IndexOf(tables_, hi, *hash);
+  }
+  // Moves each element on "chain" one step toward the empty chain->front(),
+  // vacating chain->back().
+  void EvictChain(const Chain& chain);
+  // Checks that "chain" can still be executed. Used by concurrent writers,
+  // with the stripes of the chain locked.
+  bool ValidChain(const Chain& chain);
+  // Returns the hash for table "hi" of the element at current slot "c".
+  HashValue StoredOrComputedHash(Coord c, int hi) {
+    if (StoreHash) return (*HashesIn(tables_, c.table, c.index))[hi];
+    if (kDerivedHashes) return DeriveHash(opts_.Hash(0, Slot(c)), hi);
+    return opts_.Hash(hi, Slot(c));
+  }
+  // Stores "key", whose hashes are "hashes", at "slot", which must be empty.
+  template <typename Key, typename... Args>
+  iterator InitSlot(Coord slot, Key&& key,
+                    const std::array<HashValue, NumHashes>& hashes,
+                    Args&&... args) {
+    iterator it = {this, slot.table, slot.index};
+    opts_.Init(it.table, slot.hash, std::forward<Key>(key), &*it,
+               std::forward<Args>(args)...);
+    SetTag(&tables_, it.table, it.index, TagOf(slot.hash));
+    if (StoreHash) *HashesIn(tables_, it.table, it.index) = hashes;
+    Trace(LpCockooHashTraceEvent::kInsert, it.table, it.index);
+    return it;
+  }
+  // Looks for "key" in the windows of the current tables and the stash.
+  iterator FindInWindows(const K& key,
+                         const std::array<HashValue, NumHashes>& hashes) const;
+  // Stores "key" in the stash. Returns end() if it is full.
+  template <typename Key, typename... Args>
+  iterator InsertStash(Key&& key,
+                       const std::array<HashValue, NumHashes>& hashes,
+                       Args&&... args);
+  // Implements insert, try_emplace and insert_or_assign. "Assign" selects
+  // the last.
+  template <bool Assign, typename Key, typename... Args>
+  std::pair<iterator, bool> Emplace(Key&& key, Args&&... args);
+  template <bool Assign, typename Key, typename... Args>
+  std::pair<iterator, bool> EmplaceConcurrent(Key&& key, Args&&... args);
+  // Returns {it, false} for the existing element "it" of "key". If "Assign",
+  // first passes "args" to Init for the element.
+  template <bool Assign, typename Key, typename... Args>
+  std::pair<iterator, bool> Existing(
+      iterator it, Key&& key, const std::array<HashValue, NumHashes>& hashes,
+      Args&&... args) {
+    // Old tables are numbered NumHashes + hi, and the stash uses hash 0.
+    const int hi = it.table % NumHashes;
+    if (Assign) {
+      opts_.Init(hi, hashes[hi], std::forward<Key>(key), &*it,
+                 std::forward<Args>(args)...);
+    }
+    return std::make_pair(it, false);
+  }
+
+  // Returns Tables::buckets for tables that hold "elems" elements at
+  // LoadFactor.
+  static size_t BucketsFor(size_t elems) {
+    if (elems == 0) elems = 1;
+    return TableSize((elems / LoadFactor - 1) / NumHashes + 1);
+  }
+  // Returns the number of elements. Takes a scan of the tables.
+  size_t CountElems() const {
+    size_t n = 0;
+    for (iterator it = begin(); it != end(); ++it) n++;
+    return n;
+  }
+  // Past this many failed resizes in a row, Migrate leaves an element that
+  // the new tables cannot take in the old tables.
+  static constexpr int kMaxFailedResizes = 4;
+  // Starts moving all elements into tables twice as large. Returns false if
+  // the in-flight resize is stuck on an element that kMaxFailedResizes
+  // resizes in a row could not place.
+  bool Grow();
+  // Starts moving all elements into new tables of "buckets" buckets. The
+  // previous resize must be finished.
+  void StartResize(size_t buckets);
+  // Moves up to "n" slots from the old tables to the current tables.
+  void Migrate(size_t n);
+  // Moves "elem" to the current tables. "elem" becomes empty on success.
+  // "stored", if not null, holds the hashes of "elem".
+  bool MoveToTables(V* elem,
+                    const std::array<HashValue, NumHashes>* stored = nullptr);
+  // Synchronously moves all elements into new tables of at least "buckets"
+  // slots each. An in-flight resize may be left stuck; see Migrate.
+  void Rehash(size_t buckets);
+  // Returns the index of a free stash slot, or -1 if the stash is full.
+  int FreeStashSlot() const;
+  // Moves stash elements back to the tables where possible.
+  void DrainStash();
+
+  // Returns the first element at or after slot "index" of "table", in
+  // iterator order, or end().
+  iterator NextElem(int table, size_t index) const;
+  // Returns the first element in slots [index, end) of table "hi" of "t", or
+  // "end".
+  size_t NextInTable(const Tables& t, int hi, size_t index, size_t end) const;
+  template <typename Fn>
+  void ForEachIn(const range& r, Fn& fn) const;
+  // Returns the first slot in [index, end) of "table" (numbered as in
+  // iterator) whose address starts a cache line, or "end" if there is none.
+  // With Interleave, whose table slots are not in address order, returns
+  // "index" for the tables.
+  size_t LineBoundary(int table, size_t index, size_t end) const {
+    if (Interleave && table != kStashTable) return index;
+    // Slot addresses repeat their offset in a line every 64 slots at most.
+    for (size_t i = index; i < end && i < index + 64; i++) {
+      if (reinterpret_cast<uintptr_t>(SlotAt(table, i)) % 64 == 0) return i;
+    }
+    return end;
+  }
+
+  // Concurrent writers count their inserts in per-thread shards of
+  // move_counts_, so that they do not all update one cache line. A shard
+  // spans whole cache lines, as move_counts_ is cache-line aligned.
+  static constexpr int kCountShards = Concurrent ? 16 : 1;
+  static constexpr int kCountStride = (MaxSearchDepth + 1 + 7) / 8 * 8;
+  static int CountShard() {
+    if (kCountShards == 1) return 0;
+    static std::atomic<int> next_shard(0);
+    static thread_local int shard =
+        next_shard.fetch_add(1, std::memory_order_relaxed) % kCountShards;
+    return shard;
+  }
+  static void Increment(uint64_t* count) { (*count)++; }
+  static void Increment(std::atomic<uint64_t>* count) {
+    count->fetch_add(1, std::memory_order_relaxed);
+  }
+  static uint64_t LoadCount(uint64_t count) { return count; }
+  static uint64_t LoadCount(const std::atomic<uint64_t>& count) {
+    return count.load(std::memory_order_relaxed);
+  }
+  // Counts an insert that moved "moves" elements.
+  void CountInsert(size_t moves) {
+    Increment(&move_counts_[CountShard() * kCountStride + moves]);
+  }
+
+  // Returns the stripe that guards the slot of "it".
+  size_t StripeAt(iterator it) const {
+    return it.table == kStashTable ? kStashStripe
+                                   : StripeOf(it.table % NumHashes, it.index);
+  }
+  // Empties the slot of "it". Concurrent callers must hold its stripe.
+  void ClearSlot(iterator it);
+  // Erases the element at "it" of a Concurrent table if pred holds for it.
+  // Returns true if it did.
+  template <typename Pred>
+  bool EraseIfMatches(iterator it, Pred& pred);
+
+  V* SlotAt(int table, size_t index) const {
+    if (table < NumHashes) return SlotIn(tables_, table, index);
+    if (table == kStashTable) return &stash_[index];
+    return SlotIn(old_tables_, table - NumHashes, index);
+  }
+  V* MutableSlot(Coord c) { return SlotIn(tables_, c.table, c.index); }
+  const V& Slot(Coord c) const { return *SlotIn(tables_, c.table, c.index); }
+
+  void Trace(LpCockooHashTraceEvent::Type type, int table, size_t index,
+             int table2 = -1, size_t index2 = 0) {
+    Trace(lp_cockoo_hash_internal::HasTrace<Opts>(),
+          LpCockooHashTraceEvent{type, table, index, table2, index2});
+  }
+  void Trace(std::true_type, const LpCockooHashTraceEvent& e) {
+    opts_.Trace(e);
+  }
+  void Trace(std::false_type, const LpCockooHashTraceEvent& e) {}
+
+  Tables tables_;      // Inserts go here.
+  Tables old_tables_;  // Tables being drained. buckets == 0 if not resizing.
+  // Next slot in old_tables_ to be moved.
+  int migrate_table_;
+  size_t migrate_index_;
+  // # of resizes in a row whose new tables could not take every element.
+  int failed_resizes_ = 0;
+  V* stash_;
+  // # of non-empty slots in stash_.
+  typename std::conditional<Concurrent, std::atomic<int>, int>::type
+      stash_size_{0};
   Opts opts_;
-  std::vector<Coord> tmp_queue_;
-  std::vector<Coord> tmp_chain_;
+  // Version counters of Concurrent tables, LockStripes + 1 of them.
+  std::unique_ptr<std::atomic<uint64_t>[]> stripes_;
+  // Scratch space of non-Concurrent tables.
+  SearchQueue tmp_queue_;
+  Chain tmp_chain_;
+  // Number of random walks of non-Concurrent tables.
+  uint64_t walks_ = 0;
+  // move_counts_[s * kCountStride + n] is the number of inserts that moved
+  // n elements, counted by the threads of shard s.
+  alignas(64) typename std::conditional<Concurrent, std::atomic<uint64_t>,
+                                        uint64_t>::type
+      move_counts_[kCountShards * kCountStride] = {};
 };
 
 template <typename K, typename V, typename Ops>
-typename LpCockooHash<K, V, Ops>::Coord LpCockooHash<K, V, Ops>::EvictChain(
-    Coord tail, const std::vector<Coord>& queue) {
-  std::vector<Coord>* chain = &tmp_chain_;
-  chain->clear();
-  chain->push_back(tail);
-  while (tail.parent != kNoParent) {
-    if (tail.parent >= queue.size()) abort();
-    chain->push_back(queue[tail.parent]);
-    tail = queue[tail.parent];
-  }
-  if (chain->size() < 2) {
-    abort();
-  }
-  for (size_t i = 0; i < chain->size() - 1; i++) {
-    Coord c0 = (*chain)[i];
+constexpr size_t LpCockooHash<K, V, Ops>::kStashStripe;
+
+template <typename K, typename V, typename Ops>
+void LpCockooHash<K, V, Ops>::EvictChain(const Chain& chain) {
+  assert(chain.size() >= 2);
+  // The swaps along the chain rotate the elements, so they are done as one
+  // rotation: n + 1 moves of V rather than 3n.
+  V empty = std::move(*MutableSlot(chain[0]));
+  for (size_t i = 0; i < chain.size() - 1; i++) {
+    Coord c0 = chain[i];
     V* v0 = MutableSlot(c0);
-    Coord c1 = (*chain)[i + 1];
+    Coord c1 = chain[i + 1];
     V* v1 = MutableSlot(c1);
-    std::cout << "Swap: " << CoordDebugString(c0) << "<->"
-              << CoordDebugString(c1) << ")\n";
-    std::swap(*v0, *v1);
+    Trace(LpCockooHashTraceEvent::kSwap, c0.table, c0.index, c1.table,
+          c1.index);
+    *v0 = std::move(*v1);
+    if (StoreHash) {
+      *HashesIn(tables_, c0.table, c0.index) =
+          *HashesIn(tables_, c1.table, c1.index);
+    }
+    // A partial-key tag is the same in every table; other tags are not.
+    SetTag(&tables_, c0.table, c0.index,
+           PartialKey ? *TagIn(tables_, c1.table, c1.index) : TagOf(c0.hash));
+  }
+  Coord vacated = chain.back();
+  *MutableSlot(vacated) = std::move(empty);
+  SetTag(&tables_, vacated.table, vacated.index, 0);
+  Trace(LpCockooHashTraceEvent::kVacate, vacated.table, vacated.index);
+  assert(opts_.Empty(Slot(vacated)));
+}
+
+template <typename K, typename V, typename Ops>
+bool LpCockooHash<K, V, Ops>::ValidChain(const Chain& chain) {
+  if (!opts_.Empty(Slot(chain[0]))) return false;
+  for (size_t i = 0; i < chain.size() - 1; i++) {
+    // The element now at chain[i + 1] may differ from the one the search saw,
+    // but it can still move to chain[i] if it has the same hash.
+    const V& elem = Slot(chain[i + 1]);
+    if (opts_.Empty(elem)) return false;
+    if (PartialKey) {
+      const size_t ti = AltIndex(chain[i + 1].table, chain[i + 1].index,
+                                 chain[i].table);
+      if (chain[i].index / BucketWidth != ti / BucketWidth) return false;
+    } else if (StoredOrComputedHash(chain[i + 1], chain[i].table) !=
+               chain[i].hash) {
+      return false;
+    }
   }
-  Coord vacated = chain->back();
-  std::cout << "Vacate: " << CoordDebugString(vacated) << "\n";
-  if (!opts_.Empty(Slot(vacated))) abort();
-  return vacated;
+  return true;
+}
+
+template <typename K, typename V, typename Ops>
+bool LpCockooHash<K, V, Ops>::ProbeWindow(const Tables& t, int hi,
+                                          HashValue hash, const K& key,
+                                          size_t* index) const {
+  size_t ti = IndexOf(t, hi, hash);
+  if (TagBits > 0) {
+    uint32_t mask = lp_cockoo_hash_internal::MatchTags<BucketWidth>(
+        TagIn(t, hi, ti), TagOf(hash));
+    for (; mask != 0; mask &= mask - 1) {
+      const size_t i = ti + lp_cockoo_hash_internal::CountTrailingZeros(mask);
+      if (SlotHasKey(t, hi, i, hash, key)) {
+        *index = i;
+        return true;
+      }
+    }
+    return false;
+  }
+  for (int dd = 0; dd < BucketWidth; dd++) {
+    if (SlotHasKey(t, hi, ti, hash, key)) {
+      *index = ti;
+      return true;
+    }
+    ti++;
+  }
+  return false;
 }
 
 template <typename K, typename V, typename Ops>
 typename LpCockooHash<K, V, Ops>::iterator LpCockooHash<K, V, Ops>::find(
     const K& key) const {
+  std::array<HashValue, NumHashes> hashes;
+  size_t ti;
   for (int hi = 0; hi < NumHashes; hi++) {
-    const size_t hash = opts_.Hash(hi, key);
-    size_t ti = hash % buckets_per_table_;
-    for (int dd = 0; dd < BucketWidth; dd++) {
-      V* elem = &tables_[hi][ti];
-      if (opts_.Equals(hash, key, *elem)) {
-        return iterator{this, hi, ti};
+    hashes[hi] = HashFor(hi, key, hashes);
+    if (ProbeWindow(tables_, hi, hashes[hi], key, &ti)) {
+      return iterator{this, hi, ti};
+    }
+  }
+  return FindOverflow(key, hashes);
+}
+
+template <typename K, typename V, typename Ops>
+bool LpCockooHash<K, V, Ops>::find(const K& key, V* value) const {
+  if (!Concurrent) {
+    iterator it = find(key);
+    if (it == end()) return false;
+    *value = *it;
+    return true;
+  }
+  // Read the version of each window (and of the stash) just before probing
+  // it, and hash for table hi + 1 only after table hi misses. A hit is valid
+  // if its window has not changed since its version was read. A miss must
+  // validate every window at once: validating each table separately could
+  // miss a key that an eviction moves from an unprobed table to a probed one.
+  std::array<HashValue, NumHashes> hashes;
+  std::array<size_t, 2 * NumHashes + 1> stripes;
+  std::array<uint64_t, 2 * NumHashes + 1> versions;
+  int hashed = 0;
+  stripes[2 * NumHashes] = kStashStripe;
+  for (;;) {
+    size_t ti;
+    for (int hi = 0; hi < NumHashes; hi++) {
+      if (hi == hashed) {
+        hashes[hi] = HashFor(hi, key, hashes);
+        ti = IndexOf(tables_, hi, hashes[hi]);
+        stripes[2 * hi] = StripeOf(hi, ti);
+        stripes[2 * hi + 1] = StripeOf(hi, WindowLast(tables_, ti));
+        hashed++;
+      }
+      versions[2 * hi] = ReadStripe(stripes[2 * hi]);
+      versions[2 * hi + 1] = ReadStripe(stripes[2 * hi + 1]);
+      if (ProbeWindow(tables_, hi, hashes[hi], key, &ti)) {
+        *value = *SlotIn(tables_, hi, ti);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (ValidVersions(stripes, versions, 2 * hi, 2 * hi + 2)) return true;
+        break;
+      }
+    }
+    if (hashed < NumHashes) continue;  // Retry a hit that was invalid.
+    versions[2 * NumHashes] = ReadStripe(kStashStripe);
+    bool found = false;
+    if (stash_size_ > 0) {
+      for (int si = 0; si < StashSize && !found; si++) {
+        if (opts_.Equals(hashes[0], key, stash_[si])) {
+          *value = stash_[si];
+          found = true;
+        }
+      }
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (ValidVersions(stripes, versions, 0, stripes.size())) return found;
+  }
+}
+
+template <typename K, typename V, typename Ops>
+typename LpCockooHash<K, V, Ops>::iterator
+LpCockooHash<K, V, Ops>::FindOverflow(
+    const K& key, const std::array<HashValue, NumHashes>& hashes) const {
+  size_t ti;
+  if (resizing()) {
+    for (int hi = 0; hi < NumHashes; hi++) {
+      if (ProbeWindow(old_tables_, hi, hashes[hi], key, &ti)) {
+        return iterator{this, NumHashes + hi, ti};
+      }
+    }
+  }
+  if (stash_size_ > 0) {
+    for (int si = 0; si < StashSize; si++) {
+      if (opts_.Equals(hashes[0], key, stash_[si])) {
+        return iterator{this, kStashTable, static_cast<size_t>(si)};
       }
-      ti++;
-      if (ti >= buckets_per_table_) ti = 0;
     }
   }
   return end();
 }
 
 template <typename K, typename V, typename Ops>
+void LpCockooHash<K, V, Ops>::find_batch(const K* keys, size_t n,
+                                         iterator* out) const {
+  std::array<std::array<HashValue, NumHashes>, kFindBatch> hashes;
+  for (size_t base = 0; base < n; base += kFindBatch) {
+    const size_t batch = n - base < kFindBatch ? n - base : kFindBatch;
+    for (size_t i = 0; i < batch; i++) {
+      for (int hi = 0; hi < NumHashes; hi++) {
+        hashes[i][hi] = HashFor(hi, keys[base + i], hashes[i]);
+        PrefetchWindow(hi, hashes[i][hi]);
+      }
+    }
+    for (size_t i = 0; i < batch; i++) {
+      const K& key = keys[base + i];
+      out[base + i] = end();
+      size_t ti;
+      for (int hi = 0; hi < NumHashes; hi++) {
+        if (ProbeWindow(tables_, hi, hashes[i][hi], key, &ti)) {
+          out[base + i] = iterator{this, hi, ti};
+          break;
+        }
+      }
+      if (out[base + i] == end()) out[base + i] = FindOverflow(key, hashes[i]);
+    }
+  }
+}
+
+template <typename K, typename V, typename Ops>
+template <bool Assign, typename Key, typename... Args>
 std::pair<typename LpCockooHash<K, V, Ops>::iterator, bool>
-LpCockooHash<K, V, Ops>::insert(const K& key) {
+LpCockooHash<K, V, Ops>::Emplace(Key&& key, Args&&... args) {
+  if (Concurrent) {
+    return EmplaceConcurrent<Assign>(std::forward<Key>(key),
+                                     std::forward<Args>(args)...);
+  }
+  if (resizing()) Migrate(MigrateBatch);
   std::array<size_t, NumHashes> hashes;
 
-  iterator empty_slot = end();
+  // The first empty slot in the windows, with the key's hash for its table.
+  Coord empty_slot = Coord();
+  bool found_empty = false;
   for (int hi = 0; hi < NumHashes; hi++) {
-    const HashValue hash = opts_.Hash(hi, key);
+    const HashValue hash = HashFor(hi, key, hashes);
     hashes[hi] = hash;
-    size_t ti = hash % buckets_per_table_;
+    size_t ti = IndexOf(tables_, hi, hash);
+    if (TagBits > 0) {
+      if (ProbeWindow(tables_, hi, hash, key, &ti)) {
+        return Existing<Assign>(iterator{this, hi, ti}, std::forward<Key>(key),
+                                hashes, std::forward<Args>(args)...);
+      }
+      if (!found_empty && FindEmptyInWindow(hi, hash, &ti)) {
+        empty_slot = Coord{0, kNoParent, hi, ti, hash};
+        found_empty = true;
+      }
+      continue;
+    }
     for (int dd = 0; dd < BucketWidth; dd++) {
-      V* elem = &tables_[hi][ti];
-      if (empty_slot == end() && opts_.Empty(*elem)) {
-        empty_slot = iterator{this, hi, ti};
-      } else if (opts_.Equals(hash, key, *elem)) {
-        return std::make_pair(iterator{this, hi, ti}, false);
+      V* elem = SlotIn(tables_, hi, ti);
+      if (!found_empty && opts_.Empty(*elem)) {
+        empty_slot = Coord{0, kNoParent, hi, ti, hash};
+        found_empty = true;
+      } else if (SlotHasKey(tables_, hi, ti, hash, key)) {
+        return Existing<Assign>(iterator{this, hi, ti}, std::forward<Key>(key),
+                                hashes, std::forward<Args>(args)...);
       }
       ti++;
-      if (ti >= buckets_per_table_) ti = 0;
     }
   }
-  if (empty_slot != end()) {
-    opts_.Init(empty_slot.table, hashes[empty_slot.table], key, &*empty_slot);
-    std::cout << "Insert: " << empty_slot.table << ":" << empty_slot.index
-              << "\n";
-    return std::make_pair(empty_slot, true);
+  iterator existing = FindOverflow(key, hashes);
+  if (existing != end()) {
+    return Existing<Assign>(existing, std::forward<Key>(key), hashes,
+                            std::forward<Args>(args)...);
+  }
+  if (found_empty) {
+    CountInsert(0);
+    return std::make_pair(InitSlot(empty_slot, std::forward<Key>(key), hashes,
+                                   std::forward<Args>(args)...),
+                          true);
   }
 
   // All slots are full.
-  std::vector<Coord>* queue = &tmp_queue_;
+  Coord vacated;
+  for (;;) {
+    if (EvictSlot(hashes, &vacated)) {
+      CountInsert(tmp_chain_.size() - 1);
+      break;
+    }
+    // InsertStash consumes "key" and "args" only when it succeeds.
+    iterator it = InsertStash(std::forward<Key>(key), hashes,
+                              std::forward<Args>(args)...);
+    if (it != end()) return std::make_pair(it, true);
+    if (!AutoResize || !Grow()) return std::make_pair(end(), false);
+    if (FindEmptySlot(hashes, &vacated)) {
+      CountInsert(0);
+      break;
+    }
+  }
+  // Both set vacated.hash to the key's hash for vacated.table.
+  return std::make_pair(InitSlot(vacated, std::forward<Key>(key), hashes,
+                                 std::forward<Args>(args)...),
+                        true);
+}
+
+template <typename K, typename V, typename Ops>
+typename LpCockooHash<K, V, Ops>::iterator
+LpCockooHash<K, V, Ops>::FindInWindows(
+    const K& key, const std::array<HashValue, NumHashes>& hashes) const {
+  size_t ti;
+  for (int hi = 0; hi < NumHashes; hi++) {
+    if (ProbeWindow(tables_, hi, hashes[hi], key, &ti)) {
+      return iterator{this, hi, ti};
+    }
+  }
+  return FindOverflow(key, hashes);
+}
+
+template <typename K, typename V, typename Ops>
+template <typename Key, typename... Args>
+typename LpCockooHash<K, V, Ops>::iterator
+LpCockooHash<K, V, Ops>::InsertStash(
+    Key&& key, const std::array<HashValue, NumHashes>& hashes,
+    Args&&... args) {
+  const int si = FreeStashSlot();
+  if (si < 0) return end();
+  iterator it = {this, kStashTable, static_cast<size_t>(si)};
+  opts_.Init(0, hashes[0], std::forward<Key>(key), &*it,
+             std::forward<Args>(args)...);
+  stash_size_++;
+  Trace(LpCockooHashTraceEvent::kStash, it.table, it.index);
+  return it;
+}
+
+template <typename K, typename V, typename Ops>
+template <bool Assign, typename Key, typename... Args>
+std::pair<typename LpCockooHash<K, V, Ops>::iterator, bool>
+LpCockooHash<K, V, Ops>::EmplaceConcurrent(Key&& key, Args&&... args) {
+  std::array<HashValue, NumHashes> hashes;
+  for (int hi = 0; hi < NumHashes; hi++) hashes[hi] = HashFor(hi, key, hashes);
+  StripeList stripes;
+  SearchQueue queue;
+  Chain chain;
+  for (;;) {
+    // Look for the key or an empty slot with the windows locked.
+    stripes.clear();
+    AddWindowStripes(hashes, &stripes);
+    LockAll(&stripes);
+    iterator it = FindInWindows(key, hashes);
+    if (it != end()) {
+      const auto result = Existing<Assign>(it, std::forward<Key>(key), hashes,
+                                           std::forward<Args>(args)...);
+      UnlockAll(stripes);
+      return result;
+    }
+    Coord slot;
+    if (FindEmptySlot(hashes, &slot)) {
+      it = InitSlot(slot, std::forward<Key>(key), hashes,
+                    std::forward<Args>(args)...);
+      CountInsert(0);
+      UnlockAll(stripes);
+      return std::make_pair(it, true);
+    }
+    UnlockAll(stripes);
+
+    // Search for an eviction path without holding any lock.
+    const bool found = FindEvictionPath(hashes, &queue, &chain);
+
+    // Lock the windows and the path, and check that nobody has inserted the
+    // key or changed the path in the meantime.
+    for (const Coord& c : chain) stripes.push_back(StripeOf(c.table, c.index));
+    LockAll(&stripes);
+    it = FindInWindows(key, hashes);
+    if (it != end()) {
+      const auto result = Existing<Assign>(it, std::forward<Key>(key), hashes,
+                                           std::forward<Args>(args)...);
+      UnlockAll(stripes);
+      return result;
+    }
+    if (!found) {
+      // An erase may have freed a window slot while no lock was held.
+      if (FindEmptySlot(hashes, &slot)) {
+        it = InitSlot(slot, std::forward<Key>(key), hashes,
+                      std::forward<Args>(args)...);
+        CountInsert(0);
+      } else {
+        it = InsertStash(std::forward<Key>(key), hashes,
+                         std::forward<Args>(args)...);
+      }
+      UnlockAll(stripes);
+      return std::make_pair(it, it != end());
+    }
+    if (ValidChain(chain)) {
+      EvictChain(chain);
+      it = InitSlot(chain.back(), std::forward<Key>(key), hashes,
+                    std::forward<Args>(args)...);
+      CountInsert(chain.size() - 1);
+      UnlockAll(stripes);
+      return std::make_pair(it, true);
+    }
+    UnlockAll(stripes);
+  }
+}
+
+template <typename K, typename V, typename Ops>
+bool LpCockooHash<K, V, Ops>::FindEmptyInWindow(int hi, HashValue hash,
+                                                size_t* index) const {
+  size_t ti = IndexOf(tables_, hi, hash);
+  if (TagBits > 0) {
+    uint32_t mask =
+        lp_cockoo_hash_internal::MatchTags<BucketWidth>(TagIn(tables_, hi, ti),
+                                                        0);
+    for (; mask != 0; mask &= mask - 1) {
+      const size_t i = ti + lp_cockoo_hash_internal::CountTrailingZeros(mask);
+      if (opts_.Empty(*SlotIn(tables_, hi, i))) {
+        *index = i;
+        return true;
+      }
+    }
+    return false;
+  }
+  for (int dd = 0; dd < BucketWidth; dd++) {
+    if (opts_.Empty(*SlotIn(tables_, hi, ti))) {
+      *index = ti;
+      return true;
+    }
+    ti++;
+  }
+  return false;
+}
+
+template <typename K, typename V, typename Ops>
+bool LpCockooHash<K, V, Ops>::FindEmptySlot(
+    const std::array<HashValue, NumHashes>& hashes, Coord* slot) const {
+  size_t ti;
+  for (int hi = 0; hi < NumHashes; hi++) {
+    if (FindEmptyInWindow(hi, hashes[hi], &ti)) {
+      *slot = Coord{0, kNoParent, hi, ti, hashes[hi]};
+      return true;
+    }
+  }
+  return false;
+}
+
+template <typename K, typename V, typename Ops>
+bool LpCockooHash<K, V, Ops>::EvictSlot(
+    const std::array<HashValue, NumHashes>& hashes, Coord* slot) {
+  if (!FindEvictionPath(hashes, &tmp_queue_, &tmp_chain_)) return false;
+  EvictChain(tmp_chain_);
+  *slot = tmp_chain_.back();
+  return true;
+}
+
+template <typename K, typename V, typename Ops>
+bool LpCockooHash<K, V, Ops>::FindEvictionPath(
+    const std::array<HashValue, NumHashes>& hashes, SearchQueue* queue,
+    Chain* chain) {
+  switch (Eviction) {
+    case LpCockooHashEviction::kBfs:
+      return FindBfsPath(hashes, MaxSearchDepth, queue, chain);
+    case LpCockooHashEviction::kRandomWalk:
+      return FindRandomWalkPath(hashes, chain);
+    case LpCockooHashEviction::kHybrid:
+      return FindBfsPath(hashes, kHybridBfsDepth, queue, chain) ||
+             FindRandomWalkPath(hashes, chain);
+  }
+  return false;
+}
+
+template <typename K, typename V, typename Ops>
+bool LpCockooHash<K, V, Ops>::FindBfsPath(
+    const std::array<HashValue, NumHashes>& hashes, int max_depth,
+    SearchQueue* queue, Chain* chain) {
   queue->clear();
+  chain->clear();
 
   // Do a BFS to find a chain of entries that leads to an empty slot. See the
   // LAKF paper for details.
   for (int hash_idx = 0; hash_idx < NumHashes; hash_idx++) {
-    size_t ti = hashes[hash_idx] % buckets_per_table_;
+    size_t ti = IndexOf(tables_, hash_idx, hashes[hash_idx]);
     for (int dd = 0; dd < BucketWidth; dd++) {
-      queue->push_back(Coord{queue->size(), kNoParent, hash_idx, ti});
+      queue->push_back(
+          Coord{queue->size(), kNoParent, hash_idx, ti, hashes[hash_idx]});
       ti++;
-      if (ti >= buckets_per_table_) ti = 0;
     }
   }
 
   size_t qi = 0;
-  for (int rep = 0; rep < 100; rep++) {
+  // Vacating (*queue)[qi] takes "depth" moves. Entries before "level_end"
+  // are at that depth.
+  int depth = 1;
+  size_t level_end = queue->size();
+  for (int expanded = 0; expanded < MaxSearchNodes && qi < queue->size();
+       expanded++) {
+    if (qi == level_end) {
+      depth++;
+      level_end = queue->size();
+    }
     const Coord c = (*queue)[qi];  // prospective elem to be evicted
-    const V& elem = tables_[c.table][c.index];
 
     for (int hash_idx2 = 0; hash_idx2 < NumHashes; hash_idx2++) {
       if (hash_idx2 == c.table) continue;
-      const size_t hash = opts_.Hash(hash_idx2, elem);
-      size_t ti = hash % buckets_per_table_;
+      HashValue hash = 0;
+      size_t ti = AltWindow(c, hash_idx2, &hash);
       for (int dd = 0; dd < BucketWidth; dd++) {
-        const Coord c2 = {queue->size(), qi, hash_idx2, ti};
-        V* dest_elem = MutableSlot(c2);
-        if (opts_.Empty(*dest_elem)) {
-          Coord vacated = EvictChain(c2, *queue);
-
-          iterator it = {this, vacated.table, vacated.index};
-          opts_.Init(it.table, hashes[it.table], key, &*it);
-          std::cout << "Insert(2): " << it.table << ":" << it.index << "\n";
-          return std::make_pair(it, true);
-        }
-        queue->push_back(c2);
+        const Coord c2 = {queue->size(), qi, hash_idx2, ti, hash};
         ti++;
-        if (ti >= buckets_per_table_) ti = 0;
+        // A path must not visit a slot twice, or the moves along it would
+        // misplace elements.
+        bool cycle = false;
+        for (size_t pi = qi; pi != kNoParent && !cycle;
+             pi = (*queue)[pi].parent) {
+          cycle = (*queue)[pi].table == c2.table &&
+                  (*queue)[pi].index == c2.index;
+        }
+        if (cycle) continue;
+        if (opts_.Empty(Slot(c2))) {
+          chain->push_back(c2);
+          for (size_t pi = qi; pi != kNoParent; pi = (*queue)[pi].parent) {
+            chain->push_back((*queue)[pi]);
+          }
+          return true;
+        }
+        if (depth < max_depth) queue->push_back(c2);
       }
     }
     qi++;
   }
-  abort();
-  return std::make_pair(end(), false);
+  return false;
+}
+
+template <typename K, typename V, typename Ops>
+bool LpCockooHash<K, V, Ops>::FindRandomWalkPath(
+    const std::array<HashValue, NumHashes>& hashes, Chain* chain) {
+  chain->clear();
+  if (NumHashes < 2) return false;
+  // Mix a fresh number into the key's hash, so that a retry for the same
+  // key (after ValidChain fails, after Grow, or during Rehash) takes new
+  // random choices.
+  uint64_t seed = hashes[0] ^ lp_cockoo_hash_internal::Remix(NextWalk());
+  auto random = [&seed](uint64_t n) {
+    seed += 0x9e3779b97f4a7c15ULL;
+    return lp_cockoo_hash_internal::Remix(seed) % n;
+  };
+  // path[i + 1] is the slot that the element at path[i] moves to.
+  Chain path;
+  const int hi = random(NumHashes);
+  path.push_back(Coord{0, kNoParent, hi,
+                       IndexOf(tables_, hi, hashes[hi]) + random(BucketWidth),
+                       hashes[hi]});
+  for (int step = 0; step < MaxSearchNodes; step++) {
+    const Coord c = path.back();
+    int hi2 = random(NumHashes - 1);
+    if (hi2 >= c.table) hi2++;
+    HashValue hash = 0;
+    const size_t ti = AltWindow(c, hi2, &hash);
+    // Returns the position of slot "i" of the window in "path", or
+    // path.size().
+    auto find_in_path = [&](size_t i) {
+      size_t pi = 0;
+      while (pi < path.size() &&
+             (path[pi].table != hi2 || path[pi].index != i)) {
+        pi++;
+      }
+      return pi;
+    };
+    for (int dd = 0; dd < BucketWidth; dd++) {
+      const Coord c2 = {0, kNoParent, hi2, ti + dd, hash};
+      if (opts_.Empty(Slot(c2)) && find_in_path(c2.index) == path.size()) {
+        chain->push_back(c2);
+        for (size_t pi = path.size(); pi-- > 0;) chain->push_back(path[pi]);
+        return true;
+      }
+    }
+    // A path must not visit a slot twice. If the walk returns to a slot, drop
+    // the loop and continue from there.
+    const size_t i = ti + random(BucketWidth);
+    const size_t pi = find_in_path(i);
+    if (pi < path.size()) {
+      path.truncate(pi + 1);
+    } else if (static_cast<int>(path.size()) < MaxSearchDepth) {
+      path.push_back(Coord{0, kNoParent, hi2, i, hash});
+    } else {
+      return false;
+    }
+  }
+  return false;
+}
+
+template <typename K, typename V, typename Ops>
+bool LpCockooHash<K, V, Ops>::Grow() {
+  // Growing again while the previous resize is in flight must first finish
+  // it, since only one set of old tables is kept.
+  if (resizing()) Migrate(std::numeric_limits<size_t>::max());
+  if (resizing()) return false;
+  StartResize(tables_.buckets * 2);
+  return true;
+}
+
+template <typename K, typename V, typename Ops>
+void LpCockooHash<K, V, Ops>::StartResize(size_t buckets) {
+  old_tables_ = tables_;
+  AllocTables(buckets, &tables_);
+  migrate_table_ = 0;
+  migrate_index_ = 0;
+}
+
+template <typename K, typename V, typename Ops>
+void LpCockooHash<K, V, Ops>::shrink_to_fit() {
+  if (resizing()) Migrate(std::numeric_limits<size_t>::max());
+  if (resizing()) return;
+  const size_t buckets = BucketsFor(2 * CountElems());
+  if (buckets >= tables_.buckets) return;
+  if (Concurrent) {
+    Rehash(buckets);
+  } else {
+    StartResize(buckets);
+  }
+}
+
+template <typename K, typename V, typename Ops>
+void LpCockooHash<K, V, Ops>::rehash(size_t elems) {
+  Rehash(BucketsFor(std::max(elems, CountElems())));
+}
+
+template <typename K, typename V, typename Ops>
+bool LpCockooHash<K, V, Ops>::MoveToTables(
+    V* elem, const std::array<HashValue, NumHashes>* stored) {
+  std::array<HashValue, NumHashes> hashes;
+  if (stored != nullptr) {
+    hashes = *stored;
+  } else {
+    for (int hi = 0; hi < NumHashes; hi++) {
+      hashes[hi] = ElemHashFor(hi, *elem, hashes);
+    }
+  }
+  Coord dest;
+  if (!FindEmptySlot(hashes, &dest) && !EvictSlot(hashes, &dest)) {
+    return false;
+  }
+  std::swap(*MutableSlot(dest), *elem);
+  SetTag(&tables_, dest.table, dest.index, TagOf(dest.hash));
+  if (StoreHash) *HashesIn(tables_, dest.table, dest.index) = hashes;
+  return true;
+}
+
+template <typename K, typename V, typename Ops>
+void LpCockooHash<K, V, Ops>::Migrate(size_t n) {
+  for (size_t moved = 0; moved < n; moved++) {
+    if (migrate_index_ >= SlotCount(old_tables_)) {
+      migrate_index_ = 0;
+      if (++migrate_table_ >= NumHashes) {
+        FreeTables(&old_tables_);
+        failed_resizes_ = 0;
+        DrainStash();
+        return;
+      }
+    }
+    V* elem = SlotIn(old_tables_, migrate_table_, migrate_index_);
+    if (!opts_.Empty(*elem) &&
+        !MoveToTables(elem, StoreHash ? HashesIn(old_tables_, migrate_table_,
+                                                 migrate_index_)
+                                      : nullptr)) {
+      // Rare, and only with tiny tables since the new tables are twice as
+      // large as the old ones, or, after shrink_to_fit, have room for
+      // every element at LoadFactor.
+      const int si = FreeStashSlot();
+      if (si < 0) {
+        // Past the cap, stay on "elem", where lookups still find it, rather
+        // than double the tables for a hash they cannot help.
+        if (failed_resizes_ >= kMaxFailedResizes) return;
+        failed_resizes_++;
+        Rehash(tables_.buckets * 2);
+        return;
+      }
+      std::swap(stash_[si], *elem);
+      stash_size_++;
+    }
+    migrate_index_++;
+  }
+}
+
+template <typename K, typename V, typename Ops>
+void LpCockooHash<K, V, Ops>::Rehash(size_t buckets) {
+  std::vector<Tables> sources{tables_};
+  AllocTables(buckets, &tables_);
+  for (size_t si = 0; si < sources.size(); si++) {
+    for (int hi = 0; hi < NumHashes; hi++) {
+      for (size_t ti = 0; ti < SlotCount(sources[si]); ti++) {
+        V* elem = SlotIn(sources[si], hi, ti);
+        const std::array<HashValue, NumHashes>* stored =
+            StoreHash ? HashesIn(sources[si], hi, ti) : nullptr;
+        while (!opts_.Empty(*elem) && !MoveToTables(elem, stored)) {
+          // Drain the partially filled tables into larger ones later.
+          sources.push_back(tables_);
+          AllocTables(tables_.buckets * 2, &tables_);
+        }
+      }
+    }
+  }
+  for (Tables& t : sources) FreeTables(&t);
+  // An in-flight resize goes on from where it stopped, into the new tables.
+  if (resizing()) {
+    Migrate(std::numeric_limits<size_t>::max());
+  } else {
+    DrainStash();
+  }
+}
+
+template <typename K, typename V, typename Ops>
+int LpCockooHash<K, V, Ops>::FreeStashSlot() const {
+  if (stash_size_ >= StashSize) return -1;
+  for (int si = 0; si < StashSize; si++) {
+    if (opts_.Empty(stash_[si])) return si;
+  }
+  return -1;
+}
+
+template <typename K, typename V, typename Ops>
+void LpCockooHash<K, V, Ops>::DrainStash() {
+  for (int si = 0; si < StashSize && stash_size_ > 0; si++) {
+    if (!opts_.Empty(stash_[si]) && MoveToTables(&stash_[si])) {
+      stash_size_--;
+    }
+  }
+}
+
+template <typename K, typename V, typename Ops>
+typename LpCockooHash<K, V, Ops>::iterator LpCockooHash<K, V, Ops>::NextElem(
+    int table, size_t index) const {
+  for (; table < kStashTable; table++, index = 0) {
+    if (table >= NumHashes && !resizing()) break;
+    const Tables& t = table < NumHashes ? tables_ : old_tables_;
+    index = NextInTable(t, table % NumHashes, index, SlotCount(t));
+    if (index < SlotCount(t)) return iterator{this, table, index};
+  }
+  for (index = table == kStashTable ? index : 0;
+       index < static_cast<size_t>(StashSize); index++) {
+    if (!opts_.Empty(stash_[index])) return iterator{this, kStashTable, index};
+  }
+  return end();
+}
+
+template <typename K, typename V, typename Ops>
+size_t LpCockooHash<K, V, Ops>::NextInTable(const Tables& t, int hi,
+                                            size_t index, size_t n) const {
+  if (TagBits == 0) {
+    while (index < n && opts_.Empty(*SlotIn(t, hi, index))) index++;
+    return index;
+  }
+  // Occupied slots have nonzero tags. A nonzero tag may be stale, so check
+  // the Value too. Interleaved tags are contiguous only within a bucket.
+  constexpr int kWidth = Interleave ? BucketWidth : 16 / sizeof(Tag);
+  using lp_cockoo_hash_internal::WidthMask;
+  while (index < n) {
+    if (*TagIn(t, hi, index) == 0) {
+      // Skip a run of empty slots kWidth tags at a time. The loads may read
+      // into the tag padding.
+      size_t base = Interleave ? index - index % kWidth : index;
+      uint32_t occupied =
+          ~lp_cockoo_hash_internal::MatchTags<kWidth>(TagIn(t, hi, base), 0) &
+          WidthMask(kWidth) & ~WidthMask(index - base);
+      while (occupied == 0) {
+        base += kWidth;
+        if (base >= n) return n;
+        occupied = ~lp_cockoo_hash_internal::MatchTags<kWidth>(
+                       TagIn(t, hi, base), 0) &
+                   WidthMask(kWidth);
+      }
+      index = base + lp_cockoo_hash_internal::CountTrailingZeros(occupied);
+      if (index >= n) break;
+    }
+    if (!opts_.Empty(*SlotIn(t, hi, index))) return index;
+    index++;
+  }
+  return n;
+}
+
+template <typename K, typename V, typename Ops>
+std::vector<typename LpCockooHash<K, V, Ops>::range>
+LpCockooHash<K, V, Ops>::ranges(size_t max_slots) const {
+  const size_t step = max_slots > 0 ? max_slots : 1;
+  std::vector<range> rs;
+  for (int table = 0; table < kStashTable; table++) {
+    if (table >= NumHashes && !resizing()) break;
+    const size_t n = SlotCount(table < NumHashes ? tables_ : old_tables_);
+    for (size_t begin = 0; begin < n;) {
+      const size_t end =
+          n - begin <= step ? n : LineBoundary(table, begin + step, n);
+      rs.push_back(range{this, table, begin, end});
+      begin = end;
+    }
+  }
+  if (StashSize > 0) {
+    rs.push_back(range{this, kStashTable, 0, static_cast<size_t>(StashSize)});
+  }
+  return rs;
+}
+
+template <typename K, typename V, typename Ops>
+template <typename Fn>
+void LpCockooHash<K, V, Ops>::ForEachIn(const range& r, Fn& fn) const {
+  if (r.table == kStashTable) {
+    for (size_t si = r.begin; si < r.end; si++) {
+      if (!opts_.Empty(stash_[si])) fn(stash_[si]);
+    }
+    return;
+  }
+  const Tables& t = r.table < NumHashes ? tables_ : old_tables_;
+  const int hi = r.table % NumHashes;
+  for (size_t i = NextInTable(t, hi, r.begin, r.end); i < r.end;
+       i = NextInTable(t, hi, i + 1, r.end)) {
+    fn(*SlotIn(t, hi, i));
+  }
+}
+
+template <typename K, typename V, typename Ops>
+template <typename Fn>
+void LpCockooHash<K, V, Ops>::parallel_for_each(Fn fn, int num_threads) const {
+  // Many more ranges than threads, handed out on demand, balance threads
+  // whose ranges hold more elements or sit on slower memory.
+  size_t chunk =
+      NumHashes * SlotCount(tables_) / (16 * std::max(num_threads, 1));
+  if (chunk < kMinParallelChunk) chunk = kMinParallelChunk;
+  const std::vector<range> rs = ranges(chunk);
+  std::atomic<size_t> next(0);
+  auto work = [&]() {
+    for (size_t ri; (ri = next++) < rs.size();) rs[ri].for_each(fn);
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; i++) threads.emplace_back(work);
+  work();
+  for (std::thread& th : threads) th.join();
+}
+
+template <typename K, typename V, typename Ops>
+void LpCockooHash<K, V, Ops>::ClearSlot(iterator it) {
+  opts_.Clear(&*it);
+  if (it.table < NumHashes) {
+    SetTag(&tables_, it.table, it.index, 0);
+  } else if (it.table < kStashTable) {
+    SetTag(&old_tables_, it.table - NumHashes, it.index, 0);
+  } else {
+    stash_size_--;
+  }
 }
 
 template <typename K, typename V, typename Ops>
 void LpCockooHash<K, V, Ops>::erase(iterator it) {
-  V* slot = &*it;
-  opts_.Clear(slot);
+  const size_t stripe = StripeAt(it);
+  LockStripe(stripe);
+  ClearSlot(it);
+  UnlockStripe(stripe);
+}
+
+template <typename K, typename V, typename Ops>
+size_t LpCockooHash<K, V, Ops>::erase(const K& key) {
+  if (!Concurrent) {
+    const iterator it = find(key);
+    if (it == end()) return 0;
+    ClearSlot(it);
+    return 1;
+  }
+  // Lock all the windows of the key, so that no insert can move it out of
+  // the probed slots.
+  std::array<HashValue, NumHashes> hashes;
+  for (int hi = 0; hi < NumHashes; hi++) hashes[hi] = HashFor(hi, key, hashes);
+  StripeList stripes;
+  AddWindowStripes(hashes, &stripes);
+  LockAll(&stripes);
+  const iterator it = FindInWindows(key, hashes);
+  if (it != end()) ClearSlot(it);
+  UnlockAll(stripes);
+  return it != end();
+}
+
+template <typename K, typename V, typename Ops>
+template <typename Pred>
+bool LpCockooHash<K, V, Ops>::EraseIfMatches(iterator it, Pred& pred) {
+  // Read the slot like find(key, &value) does: a copy is valid if the
+  // version of its stripe did not change while it was made.
+  const size_t stripe = StripeAt(it);
+  V elem;
+  for (;;) {
+    const uint64_t version = ReadStripe(stripe);
+    elem = *it;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (stripes_[stripe].load(std::memory_order_relaxed) == version) break;
+  }
+  if (opts_.Empty(elem) || !pred(elem)) return false;
+  // An insert may have replaced the element since it was copied.
+  LockStripe(stripe);
+  const bool match = !opts_.Empty(*it) && pred(*it);
+  if (match) ClearSlot(it);
+  UnlockStripe(stripe);
+  return match;
+}
+
+template <typename K, typename V, typename Ops>
+template <typename Pred>
+size_t LpCockooHash<K, V, Ops>::erase_if(Pred pred) {
+  size_t erased = 0;
+  if (Concurrent) {
+    // Concurrent tables never resize, so there are no old tables.
+    for (int hi = 0; hi < NumHashes; hi++) {
+      for (size_t ti = 0; ti < SlotCount(tables_); ti++) {
+        erased += EraseIfMatches(iterator{this, hi, ti}, pred);
+      }
+    }
+    for (int si = 0; si < StashSize; si++) {
+      erased += EraseIfMatches(
+          iterator{this, kStashTable, static_cast<size_t>(si)}, pred);
+    }
+    return erased;
+  }
+  for (iterator it = begin(); it != end(); ++it) {
+    if (!pred(*it)) continue;
+    ClearSlot(it);
+    erased++;
+  }
+  return erased;
 }
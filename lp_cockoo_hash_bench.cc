@@ -0,0 +1,702 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <new>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "lp_cockoo_hash.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+using Key = uint64_t;
+constexpr Key kEmpty = ~Key{0};
+
+struct Value {
+  Key key = kEmpty;
+  uint64_t value;
+};
+
+// Finalizer of MurmurHash3. The test's "k + hash_index" is too weak for
+// high load factors.
+inline size_t Mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+template <int N, int W>
+struct BenchOpts {
+  static constexpr int NumHashes = N;
+  static constexpr int BucketWidth = W;
+
+  Value* Alloc(int n) { return new Value[n](); }
+  void Free(Value* array, int n) { delete[] array; }
+
+  size_t Hash(int hash_index, Key k) const {
+    return Mix(k * NumHashes + hash_index);
+  }
+  size_t Hash(int hash_index, const Value& v) const {
+    return Hash(hash_index, v.key);
+  }
+
+  void Init(int hash_index, size_t hash, Key k, Value* v) { v->key = k; }
+  bool Equals(size_t hash, Key k, const Value& v) const { return k == v.key; }
+  bool Empty(const Value& v) const { return v.key == kEmpty; }
+  void Clear(Value* v) const { v->key = kEmpty; }
+};
+
+// BenchOpts<2, 4> with the given index reduction.
+template <LpCockooHashIndexMode M>
+struct IndexBenchOpts : BenchOpts<2, 4> {
+  static constexpr LpCockooHashIndexMode IndexMode = M;
+};
+
+// BenchOpts<2, W> with the given layout and interleaving. The tables are
+// cache-line aligned so that an aligned window of 4 16-byte Values is one
+// line.
+template <LpCockooHashLayout L, int W, bool I>
+struct LayoutBenchOpts : BenchOpts<2, W> {
+  static constexpr LpCockooHashLayout Layout = L;
+  static constexpr bool Interleave = I;
+
+  Value* Alloc(int n) {
+    void* p;
+    if (posix_memalign(&p, 64, n * sizeof(Value)) != 0) throw std::bad_alloc();
+    Value* array = static_cast<Value*>(p);
+    for (int i = 0; i < n; i++) new (&array[i]) Value();
+    return array;
+  }
+  void Free(Value* array, int n) { free(array); }
+};
+
+// BenchOpts<2, 4> whose tables are backed by huge pages if H.
+template <bool H>
+struct HugePageBenchOpts : BenchOpts<2, 4> {
+  LpCockooHashHugePageAlloc<Value> pages;
+  Value* Alloc(int n) { return H ? pages.Alloc(n) : new Value[n](); }
+  void Free(Value* array, int n) {
+    if (H) {
+      pages.Free(array, n);
+    } else {
+      delete[] array;
+    }
+  }
+};
+
+// Aligned, power-of-two BenchOpts<2, 4> with 16-bit tags, with or without
+// partial-key cuckoo hashing.
+template <bool P>
+struct PartialKeyBenchOpts : BenchOpts<2, 4> {
+  static constexpr LpCockooHashLayout Layout = LpCockooHashLayout::kAligned;
+  static constexpr LpCockooHashIndexMode IndexMode =
+      LpCockooHashIndexMode::kPowerOfTwo;
+  static constexpr int TagBits = 16;
+  static constexpr bool PartialKey = P;
+};
+
+// BenchOpts<2, 4> with tags of the given size.
+template <int Bits>
+struct TagBenchOpts : BenchOpts<2, 4> {
+  static constexpr int TagBits = Bits;
+};
+
+// BenchOpts<N, W> with the given eviction strategy.
+template <LpCockooHashEviction E, int N, int W>
+struct EvictionBenchOpts : BenchOpts<N, W> {
+  static constexpr LpCockooHashEviction Eviction = E;
+};
+
+// Calls to HashCountingBenchOpts::Hash.
+size_t hash_calls = 0;
+
+// BenchOpts<N, 4> that counts its calls to Hash.
+template <int N>
+struct HashCountingBenchOpts : BenchOpts<N, 4> {
+  size_t Hash(int hash_index, Key k) const {
+    hash_calls++;
+    return BenchOpts<N, 4>::Hash(hash_index, k);
+  }
+  size_t Hash(int hash_index, const Value& v) const {
+    return Hash(hash_index, v.key);
+  }
+};
+
+struct StringValue {
+  std::string key;
+  uint64_t value;
+};
+
+// String keys that share a long prefix, so that Equals is slow. Keys are
+// never empty.
+template <bool S>
+struct StringBenchOpts {
+  static constexpr int NumHashes = 2;
+  static constexpr int BucketWidth = 4;
+  static constexpr bool StoreHash = S;
+
+  StringValue* Alloc(int n) { return new StringValue[n](); }
+  void Free(StringValue* array, int n) { delete[] array; }
+
+  size_t Hash(int hash_index, const std::string& k) const {
+    return Mix(std::hash<std::string>()(k) * NumHashes + hash_index);
+  }
+  size_t Hash(int hash_index, const StringValue& v) const {
+    return Hash(hash_index, v.key);
+  }
+
+  void Init(int hash_index, size_t hash, const std::string& k,
+            StringValue* v) {
+    v->key = k;
+  }
+  void Init(int hash_index, size_t hash, std::string&& k, StringValue* v,
+            uint64_t value) {
+    v->key = std::move(k);
+    v->value = value;
+  }
+  bool Equals(size_t hash, const std::string& k, const StringValue& v) const {
+    return k == v.key;
+  }
+  bool Empty(const StringValue& v) const { return v.key.empty(); }
+  void Clear(StringValue* v) const { v->key.clear(); }
+};
+
+// Counts data TLB misses of this thread with perf_event_open. Count()
+// returns -1 if the counter is not available, e.g., in a container.
+class DtlbMissCounter {
+ public:
+  DtlbMissCounter() {
+#if defined(__linux__)
+    perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+  ~DtlbMissCounter() {
+#if defined(__linux__)
+    if (fd_ >= 0) close(fd_);
+#endif
+  }
+  void Start() {
+#if defined(__linux__)
+    if (fd_ >= 0) ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+  }
+  void Stop() {
+#if defined(__linux__)
+    if (fd_ >= 0) ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+  }
+  int64_t Count() const {
+    int64_t n = -1;
+#if defined(__linux__)
+    if (fd_ >= 0 && read(fd_, &n, sizeof(n)) != sizeof(n)) n = -1;
+#endif
+    return n;
+  }
+
+ private:
+  int fd_ = -1;
+};
+
+std::vector<Key> RandomKeys(size_t n, int seed) {
+  std::mt19937_64 rand(seed);
+  std::vector<Key> keys(n);
+  for (Key& k : keys) {
+    do {
+      k = rand();
+    } while (k == kEmpty);
+  }
+  return keys;
+}
+
+std::vector<std::string> StringKeys(size_t n, int seed) {
+  std::vector<std::string> keys;
+  for (Key k : RandomKeys(n, seed)) {
+    keys.push_back("/some/long/common/prefix/" + std::to_string(k));
+  }
+  return keys;
+}
+
+// Inserts keys until the table holds "load" of its slots, or until it is
+// full. Returns the keys inserted.
+template <typename Table>
+std::vector<Key> Fill(Table* t, double load, int seed) {
+  const size_t slots = Table::NumHashes * t->slots_per_table();
+  std::vector<Key> keys = RandomKeys(slots * load, seed);
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (t->insert(keys[i]).first == t->end()) {
+      keys.resize(i);
+      break;
+    }
+  }
+  return keys;
+}
+
+constexpr double kFindLoad = 0.85;
+
+// Arg: # of elements.
+template <typename Table>
+void FindHit(benchmark::State& state) {
+  Table t(state.range(0));
+  std::vector<Key> keys = Fill(&t, kFindLoad, 0);
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(1));
+  size_t i = 0;
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(t.find(keys[i]));
+    if (++i == keys.size()) i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+template <typename Table>
+void FindMiss(benchmark::State& state) {
+  Table t(state.range(0));
+  const std::vector<Key> present = Fill(&t, kFindLoad, 0);
+  const std::vector<Key> keys = RandomKeys(present.size(), 1);
+  size_t i = 0;
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(t.find(keys[i]));
+    if (++i == keys.size()) i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+template <int N, int W>
+void BM_FindHit(benchmark::State& state) {
+  FindHit<LpCockooHash<Key, Value, BenchOpts<N, W>>>(state);
+}
+
+template <int N, int W>
+void BM_FindMiss(benchmark::State& state) {
+  FindMiss<LpCockooHash<Key, Value, BenchOpts<N, W>>>(state);
+}
+
+// Compares the ways of reducing a hash to a slot index.
+template <LpCockooHashIndexMode M>
+void BM_FindHitIndex(benchmark::State& state) {
+  FindHit<LpCockooHash<Key, Value, IndexBenchOpts<M>>>(state);
+}
+
+template <LpCockooHashIndexMode M>
+void BM_FindMissIndex(benchmark::State& state) {
+  FindMiss<LpCockooHash<Key, Value, IndexBenchOpts<M>>>(state);
+}
+
+// Arg: # of elements. Looks up absent keys in a table at 80% load.
+template <bool S>
+void BM_FindMissString(benchmark::State& state) {
+  LpCockooHash<std::string, StringValue, StringBenchOpts<S>> t(
+      state.range(0));
+  for (const std::string& k : StringKeys(state.range(0) * 0.8, 0)) {
+    t.insert(k);
+  }
+  const std::vector<std::string> keys = StringKeys(1 << 16, 1);
+  size_t i = 0;
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(t.find(keys[i]));
+    i = (i + 1) & ((1 << 16) - 1);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Arg: # of elements. Fills a table to 90%, which evicts many elements.
+template <bool S>
+void BM_InsertString(benchmark::State& state) {
+  using Table = LpCockooHash<std::string, StringValue, StringBenchOpts<S>>;
+  const std::vector<std::string> keys = StringKeys(state.range(0) * 0.9, 0);
+  while (state.KeepRunning()) {
+    Table t(state.range(0));
+    for (const std::string& k : keys) benchmark::DoNotOptimize(t.insert(k));
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+// Arg: # of elements. Fills a table to 90% from a copy of the keys, with
+// insert and a write through the iterator (E = false) or with try_emplace
+// of the moved key and the value (E = true).
+template <bool E>
+void BM_EmplaceString(benchmark::State& state) {
+  using Table = LpCockooHash<std::string, StringValue, StringBenchOpts<false>>;
+  const std::vector<std::string> keys = StringKeys(state.range(0) * 0.9, 0);
+  while (state.KeepRunning()) {
+    std::vector<std::string> batch = keys;
+    Table t(state.range(0));
+    for (size_t i = 0; i < batch.size(); i++) {
+      if (E) {
+        benchmark::DoNotOptimize(t.try_emplace(std::move(batch[i]), i));
+      } else {
+        t.insert(batch[i]).first->value = i;
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+// Arg: # of elements. Reports the data TLB misses per find when the
+// counter is available.
+template <bool H>
+void BM_FindHitHugePages(benchmark::State& state) {
+  using Table = LpCockooHash<Key, Value, HugePageBenchOpts<H>>;
+  Table t(state.range(0));
+  std::vector<Key> keys = Fill(&t, kFindLoad, 0);
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(1));
+  DtlbMissCounter tlb;
+  size_t i = 0;
+  tlb.Start();
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(t.find(keys[i]));
+    if (++i == keys.size()) i = 0;
+  }
+  tlb.Stop();
+  state.SetItemsProcessed(state.iterations());
+  const int64_t misses = tlb.Count();
+  if (misses >= 0) {
+    state.counters["dtlb_misses"] =
+        static_cast<double>(misses) / state.iterations();
+  }
+}
+
+template <int N, int W>
+void BM_FindBatchHit(benchmark::State& state) {
+  using Table = LpCockooHash<Key, Value, BenchOpts<N, W>>;
+  constexpr size_t kBatch = 32;
+  Table t(state.range(0));
+  std::vector<Key> keys = Fill(&t, kFindLoad, 0);
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(1));
+  keys.resize(keys.size() / kBatch * kBatch);
+  std::vector<typename Table::iterator> out(kBatch);
+  size_t i = 0;
+  while (state.KeepRunning()) {
+    t.find_batch(&keys[i], kBatch, out.data());
+    benchmark::DoNotOptimize(out.data());
+    i += kBatch;
+    if (i == keys.size()) i = 0;
+  }
+  state.SetItemsProcessed(state.iterations() * kBatch);
+}
+
+// Arg: load factor in percent. Measures inserts that take the table from
+// (load - 5%) to load.
+template <typename Table>
+void Insert(benchmark::State& state) {
+  const double load = state.range(0) / 100.0;
+  const size_t kElems = 1 << 18;
+  int seed = 0;
+  size_t inserted = 0;
+  while (state.KeepRunning()) {
+    state.PauseTiming();
+    Table t(kElems);
+    Fill(&t, load - 0.05, seed++);
+    const std::vector<Key> keys =
+        RandomKeys(Table::NumHashes * t.slots_per_table() * 0.05, seed++);
+    state.ResumeTiming();
+    for (Key k : keys) benchmark::DoNotOptimize(t.insert(k));
+    inserted += keys.size();
+  }
+  state.SetItemsProcessed(inserted);
+}
+
+template <int N, int W>
+void BM_Insert(benchmark::State& state) {
+  Insert<LpCockooHash<Key, Value, BenchOpts<N, W>>>(state);
+}
+
+// Compare overlapping windows with aligned buckets, and separate tables
+// with interleaved ones.
+template <LpCockooHashLayout L, int W, bool I>
+void BM_FindHitLayout(benchmark::State& state) {
+  FindHit<LpCockooHash<Key, Value, LayoutBenchOpts<L, W, I>>>(state);
+}
+
+template <LpCockooHashLayout L, int W, bool I>
+void BM_FindMissLayout(benchmark::State& state) {
+  FindMiss<LpCockooHash<Key, Value, LayoutBenchOpts<L, W, I>>>(state);
+}
+
+template <LpCockooHashLayout L, int W, bool I>
+void BM_InsertLayout(benchmark::State& state) {
+  Insert<LpCockooHash<Key, Value, LayoutBenchOpts<L, W, I>>>(state);
+}
+
+template <bool P>
+void BM_InsertPartialKey(benchmark::State& state) {
+  Insert<LpCockooHash<Key, Value, PartialKeyBenchOpts<P>>>(state);
+}
+
+// Args: load factor in percent, and 1 to look up present keys (0 for absent
+// ones). Reports the calls to Opts::Hash per lookup, which approach 1 for
+// hits at low load since find stops hashing at the first table that has the
+// key.
+template <int N>
+void BM_HashesPerFind(benchmark::State& state) {
+  using Table = LpCockooHash<Key, Value, HashCountingBenchOpts<N>>;
+  Table t(1 << 18);
+  const std::vector<Key> present = Fill(&t, state.range(0) / 100.0, 0);
+  const std::vector<Key> keys =
+      state.range(1) ? present : RandomKeys(present.size(), 1);
+  hash_calls = 0;
+  size_t i = 0;
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(t.find(keys[i]));
+    if (++i == keys.size()) i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.counters["hashes_per_find"] =
+      static_cast<double>(hash_calls) / state.iterations();
+}
+
+template <LpCockooHashEviction E, int N, int W>
+void BM_InsertEviction(benchmark::State& state) {
+  Insert<LpCockooHash<Key, Value, EvictionBenchOpts<E, N, W>>>(state);
+}
+
+// Inserts keys until one fails. Reports the load reached in "max_load".
+template <LpCockooHashEviction E, int N, int W>
+void BM_MaxLoadEviction(benchmark::State& state) {
+  using Table = LpCockooHash<Key, Value, EvictionBenchOpts<E, N, W>>;
+  int seed = 0;
+  size_t inserted = 0;
+  double max_load = 0;
+  while (state.KeepRunning()) {
+    state.PauseTiming();
+    Table t(1 << 18);
+    const size_t slots = N * t.slots_per_table();
+    const std::vector<Key> keys = RandomKeys(slots, seed++);
+    state.ResumeTiming();
+    size_t n = 0;
+    while (n < keys.size() && t.insert(keys[n]).first != t.end()) n++;
+    inserted += n;
+    max_load = static_cast<double>(n) / slots;
+  }
+  state.SetItemsProcessed(inserted);
+  state.counters["max_load"] = max_load;
+}
+
+// Arg: load factor in percent. Iterates over all the elements. Reports the
+// slots scanned per second.
+template <int Bits>
+void BM_Iterate(benchmark::State& state) {
+  using Table = LpCockooHash<Key, Value, TagBenchOpts<Bits>>;
+  Table t(1 << 22);
+  Fill(&t, state.range(0) / 100.0, 0);
+  while (state.KeepRunning()) {
+    uint64_t sum = 0;
+    for (auto it = t.begin(); it != t.end(); ++it) sum += it->value;
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * 2 * t.slots_per_table());
+}
+
+// Args: 0 to keep the table as is, 1 to shrink_to_fit, or 2 to rehash to
+// exactly the element count, and the % of the keys to keep. Looks up the
+// keys left after erasing the rest from a large table. Reports the fraction
+// of them in table 0, which a hit finds with one probe.
+void BM_FindHitAfterErase(benchmark::State& state) {
+  using Table = LpCockooHash<Key, Value, BenchOpts<2, 4>>;
+  Table t(1 << 22);
+  std::vector<Key> keys = Fill(&t, kFindLoad, 0);
+  keys.resize(keys.size() * state.range(1) / 100);
+  const std::set<Key> kept(keys.begin(), keys.end());
+  t.erase_if([&kept](const Value& v) { return kept.count(v.key) == 0; });
+  if (state.range(0) == 1) {
+    t.shrink_to_fit();
+  } else if (state.range(0) == 2) {
+    t.rehash(kept.size());
+  }
+  t.migrate(std::numeric_limits<size_t>::max());
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(1));
+  size_t i = 0;
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(t.find(keys[i]));
+    if (++i == keys.size()) i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.counters["buckets"] = t.buckets_per_table();
+  size_t in_table0 = 0;
+  for (auto it = t.begin(); it != t.end(); ++it) in_table0 += it.table == 0;
+  state.counters["in_table0"] = static_cast<double>(in_table0) / keys.size();
+}
+
+// Arg: # of threads. Reads every value of a half-full table with
+// parallel_for_each. Reports the slots scanned per second.
+void BM_ParallelForEach(benchmark::State& state) {
+  using Table = LpCockooHash<Key, Value, TagBenchOpts<8>>;
+  Table t(1 << 22);
+  Fill(&t, 0.5, 0);
+  while (state.KeepRunning()) {
+    t.parallel_for_each([](Value& v) { benchmark::DoNotOptimize(v.value); },
+                        state.range(0));
+  }
+  state.SetItemsProcessed(state.iterations() * 2 * t.slots_per_table());
+}
+
+// Arg: 1 to erase by key, 0 to find and then erase the iterator. Erases all
+// the elements of a table filled to 85%.
+void BM_EraseKey(benchmark::State& state) {
+  using Table = LpCockooHash<Key, Value, BenchOpts<2, 4>>;
+  size_t erased = 0;
+  while (state.KeepRunning()) {
+    state.PauseTiming();
+    Table t(1 << 18);
+    std::vector<Key> keys = Fill(&t, kFindLoad, 0);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(1));
+    state.ResumeTiming();
+    for (Key k : keys) {
+      if (state.range(0)) {
+        t.erase(k);
+      } else {
+        t.erase(t.find(k));
+      }
+    }
+    erased += keys.size();
+  }
+  state.SetItemsProcessed(erased);
+}
+
+// Arg: % of the elements to erase. Sweeps a table filled to 85% with
+// erase_if. Reports the slots swept per second.
+void BM_EraseIf(benchmark::State& state) {
+  using Table = LpCockooHash<Key, Value, TagBenchOpts<8>>;
+  const uint64_t percent = state.range(0);
+  size_t slots = 0;
+  while (state.KeepRunning()) {
+    state.PauseTiming();
+    Table t(1 << 20);
+    Fill(&t, kFindLoad, 0);
+    state.ResumeTiming();
+    benchmark::DoNotOptimize(t.erase_if(
+        [percent](const Value& v) { return v.key % 100 < percent; }));
+    slots += 2 * t.slots_per_table();
+  }
+  state.SetItemsProcessed(slots);
+}
+
+// Arg: load factor in percent. Each iteration erases a random element and
+// inserts a new one.
+template <int N, int W>
+void BM_Churn(benchmark::State& state) {
+  using Table = LpCockooHash<Key, Value, BenchOpts<N, W>>;
+  Table t(1 << 18);
+  std::vector<Key> keys = Fill(&t, state.range(0) / 100.0, 0);
+  const std::vector<Key> fresh = RandomKeys(1 << 20, 1);
+  std::mt19937 rand(2);
+  size_t fi = 0;
+  while (state.KeepRunning()) {
+    Key& victim = keys[rand() % keys.size()];
+    auto it = t.find(victim);
+    // Missing if a previous insert found the table full.
+    if (it != t.end()) t.erase(it);
+    victim = fresh[fi++ & ((1 << 20) - 1)];
+    benchmark::DoNotOptimize(t.insert(victim));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+#define LP_COCKOO_HASH_BENCH(N, W)                                           \
+  BENCHMARK_TEMPLATE(BM_FindHit, N, W)->Arg(1 << 14)->Arg(1 << 22);          \
+  BENCHMARK_TEMPLATE(BM_FindMiss, N, W)->Arg(1 << 14)->Arg(1 << 22);         \
+  BENCHMARK_TEMPLATE(BM_FindBatchHit, N, W)->Arg(1 << 14)->Arg(1 << 22);     \
+  BENCHMARK_TEMPLATE(BM_Insert, N, W)->DenseRange(50, 95, 5);                \
+  BENCHMARK_TEMPLATE(BM_Churn, N, W)->Arg(50)->Arg(90);
+
+LP_COCKOO_HASH_BENCH(2, 2)
+LP_COCKOO_HASH_BENCH(2, 4)
+LP_COCKOO_HASH_BENCH(3, 2)
+LP_COCKOO_HASH_BENCH(4, 1)
+
+void HashesPerFindArgs(benchmark::internal::Benchmark* b) {
+  for (int load : {10, 50, 90}) {
+    for (int hit : {0, 1}) b->Args({load, hit});
+  }
+}
+
+BENCHMARK_TEMPLATE(BM_HashesPerFind, 2)->Apply(HashesPerFindArgs);
+BENCHMARK_TEMPLATE(BM_HashesPerFind, 3)->Apply(HashesPerFindArgs);
+
+BENCHMARK_TEMPLATE(BM_Iterate, 0)->Arg(5)->Arg(50)->Arg(90);
+BENCHMARK_TEMPLATE(BM_Iterate, 8)->Arg(5)->Arg(50)->Arg(90);
+BENCHMARK(BM_EraseKey)->Arg(0)->Arg(1);
+BENCHMARK(BM_FindHitAfterErase)
+    ->Args({0, 1})
+    ->Args({1, 1})
+    ->Args({2, 1})
+    ->Args({0, 5})
+    ->Args({1, 5})
+    ->Args({2, 5});
+BENCHMARK(BM_EraseIf)->Arg(10)->Arg(100);
+BENCHMARK(BM_ParallelForEach)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->UseRealTime();
+
+#define LP_COCKOO_HASH_EVICTION_BENCH(E, N, W)                     \
+  BENCHMARK_TEMPLATE(BM_InsertEviction, E, N, W)->Arg(80)->Arg(90); \
+  BENCHMARK_TEMPLATE(BM_MaxLoadEviction, E, N, W);
+
+#define LP_COCKOO_HASH_EVICTION_BENCHES(N, W)                               \
+  LP_COCKOO_HASH_EVICTION_BENCH(LpCockooHashEviction::kBfs, N, W)           \
+  LP_COCKOO_HASH_EVICTION_BENCH(LpCockooHashEviction::kRandomWalk, N, W)    \
+  LP_COCKOO_HASH_EVICTION_BENCH(LpCockooHashEviction::kHybrid, N, W)
+
+LP_COCKOO_HASH_EVICTION_BENCHES(2, 4)
+LP_COCKOO_HASH_EVICTION_BENCHES(3, 2)
+LP_COCKOO_HASH_EVICTION_BENCHES(4, 1)
+
+#define LP_COCKOO_HASH_INDEX_BENCH(M)                                     \
+  BENCHMARK_TEMPLATE(BM_FindHitIndex, M)->Arg(1 << 10)->Arg(1 << 22);  \
+  BENCHMARK_TEMPLATE(BM_FindMissIndex, M)->Arg(1 << 10)->Arg(1 << 22);
+
+LP_COCKOO_HASH_INDEX_BENCH(LpCockooHashIndexMode::kModulo)
+LP_COCKOO_HASH_INDEX_BENCH(LpCockooHashIndexMode::kMultiplyShift)
+LP_COCKOO_HASH_INDEX_BENCH(LpCockooHashIndexMode::kPowerOfTwo)
+
+BENCHMARK_TEMPLATE(BM_InsertPartialKey, false)->DenseRange(50, 90, 10);
+BENCHMARK_TEMPLATE(BM_InsertPartialKey, true)->DenseRange(50, 90, 10);
+
+BENCHMARK_TEMPLATE(BM_FindMissString, false)->Arg(1 << 14)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_FindMissString, true)->Arg(1 << 14)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_InsertString, false)->Arg(1 << 14)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_InsertString, true)->Arg(1 << 14)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_EmplaceString, false)->Arg(1 << 14)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_EmplaceString, true)->Arg(1 << 14)->Arg(1 << 20);
+
+BENCHMARK_TEMPLATE(BM_FindHitHugePages, false)->Arg(1 << 20)->Arg(1 << 24);
+BENCHMARK_TEMPLATE(BM_FindHitHugePages, true)->Arg(1 << 20)->Arg(1 << 24);
+
+#define LP_COCKOO_HASH_LAYOUT_BENCH(L, W, I)                                  \
+  BENCHMARK_TEMPLATE(BM_FindHitLayout, L, W, I)                               \
+      ->Arg(1 << 14)                                                          \
+      ->Arg(1 << 22);                                                         \
+  BENCHMARK_TEMPLATE(BM_FindMissLayout, L, W, I)                              \
+      ->Arg(1 << 14)                                                          \
+      ->Arg(1 << 22);                                                         \
+  BENCHMARK_TEMPLATE(BM_InsertLayout, L, W, I)->DenseRange(50, 95, 5);
+
+LP_COCKOO_HASH_LAYOUT_BENCH(LpCockooHashLayout::kOverlapping, 4, false)
+LP_COCKOO_HASH_LAYOUT_BENCH(LpCockooHashLayout::kAligned, 4, false)
+LP_COCKOO_HASH_LAYOUT_BENCH(LpCockooHashLayout::kAligned, 4, true)
+LP_COCKOO_HASH_LAYOUT_BENCH(LpCockooHashLayout::kOverlapping, 8, false)
+LP_COCKOO_HASH_LAYOUT_BENCH(LpCockooHashLayout::kAligned, 8, false)
+LP_COCKOO_HASH_LAYOUT_BENCH(LpCockooHashLayout::kAligned, 8, true)
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,250 @@
+// Runs the same workloads against LpCockooHash, google::dense_hash_map and
+// std::unordered_map.
+#include <benchmark/benchmark.h>
+#include <sparsehash/dense_hash_map>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "lp_cockoo_hash.h"
+
+namespace {
+using Key = uint64_t;
+constexpr Key kEmpty = ~Key{0};
+constexpr Key kDeleted = kEmpty - 1;
+
+// Finalizer of MurmurHash3. All the tables use it so that they see the same
+// hash quality.
+inline size_t Mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+struct Hasher {
+  size_t operator()(Key k) const { return Mix(k); }
+};
+
+// Bytes currently allocated by all the tables.
+size_t allocated_bytes = 0;
+
+template <typename T>
+struct CountingAllocator {
+  using value_type = T;
+  using pointer = T*;
+  using const_pointer = const T*;
+  using reference = T&;
+  using const_reference = const T&;
+  using size_type = size_t;
+  using difference_type = ptrdiff_t;
+  template <typename U>
+  struct rebind {
+    using other = CountingAllocator<U>;
+  };
+
+  CountingAllocator() = default;
+  template <typename U>
+  CountingAllocator(const CountingAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    allocated_bytes += n * sizeof(T);
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t n) {
+    allocated_bytes -= n * sizeof(T);
+    ::operator delete(p);
+  }
+  size_t max_size() const { return ~size_t{0} / sizeof(T); }
+  template <typename U, typename... Args>
+  void construct(U* p, Args&&... args) {
+    ::new (p) U(std::forward<Args>(args)...);
+  }
+  template <typename U>
+  void destroy(U* p) {
+    p->~U();
+  }
+  bool operator==(const CountingAllocator&) const { return true; }
+  bool operator!=(const CountingAllocator&) const { return false; }
+};
+
+struct Value {
+  Key key = kEmpty;
+  uint64_t value;
+};
+
+struct CompareOpts {
+  static constexpr int NumHashes = 2;
+  static constexpr int BucketWidth = 4;
+  static constexpr bool AutoResize = true;
+
+  Value* Alloc(int n) {
+    allocated_bytes += n * sizeof(Value);
+    return new Value[n]();
+  }
+  void Free(Value* array, int n) {
+    allocated_bytes -= n * sizeof(Value);
+    delete[] array;
+  }
+
+  size_t Hash(int hash_index, Key k) const { return Mix(k * 2 + hash_index); }
+  size_t Hash(int hash_index, const Value& v) const {
+    return Hash(hash_index, v.key);
+  }
+
+  void Init(int hash_index, size_t hash, Key k, Value* v) { v->key = k; }
+  bool Equals(size_t hash, Key k, const Value& v) const { return k == v.key; }
+  bool Empty(const Value& v) const { return v.key == kEmpty; }
+  void Clear(Value* v) const { v->key = kEmpty; }
+};
+
+// Adapters give the three tables the same interface.
+struct LpAdapter {
+  explicit LpAdapter(size_t n) : t(n) {}
+  void Insert(Key k, uint64_t v) { t.insert(k).first->value = v; }
+  bool Find(Key k, uint64_t* v) {
+    auto it = t.find(k);
+    if (it == t.end()) return false;
+    *v = it->value;
+    return true;
+  }
+  LpCockooHash<Key, Value, CompareOpts> t;
+};
+
+struct DenseAdapter {
+  explicit DenseAdapter(size_t n) : t(n) {
+    t.set_empty_key(kEmpty);
+    t.set_deleted_key(kDeleted);
+  }
+  void Insert(Key k, uint64_t v) { t[k] = v; }
+  bool Find(Key k, uint64_t* v) {
+    auto it = t.find(k);
+    if (it == t.end()) return false;
+    *v = it->second;
+    return true;
+  }
+  google::dense_hash_map<Key, uint64_t, Hasher, std::equal_to<Key>,
+                         CountingAllocator<std::pair<const Key, uint64_t>>>
+      t;
+};
+
+struct StdAdapter {
+  explicit StdAdapter(size_t n) { t.reserve(n); }
+  void Insert(Key k, uint64_t v) { t[k] = v; }
+  bool Find(Key k, uint64_t* v) {
+    auto it = t.find(k);
+    if (it == t.end()) return false;
+    *v = it->second;
+    return true;
+  }
+  std::unordered_map<Key, uint64_t, Hasher, std::equal_to<Key>,
+                     CountingAllocator<std::pair<const Key, uint64_t>>>
+      t;
+};
+
+std::vector<Key> RandomKeys(size_t n, int seed) {
+  std::mt19937_64 rand(seed);
+  std::vector<Key> keys(n);
+  for (Key& k : keys) {
+    do {
+      k = rand();
+    } while (k == kEmpty || k == kDeleted);
+  }
+  return keys;
+}
+
+// Returns "n" indexes into [0, range) that follow a Zipfian distribution
+// with exponent "s", rank 0 being the most frequent.
+std::vector<size_t> ZipfIndexes(size_t n, size_t range, double s, int seed) {
+  std::vector<double> cdf(range);
+  double sum = 0;
+  for (size_t i = 0; i < range; i++) {
+    sum += 1 / std::pow(i + 1, s);
+    cdf[i] = sum;
+  }
+  std::mt19937_64 rand(seed);
+  std::uniform_real_distribution<double> uniform(0, sum);
+  std::vector<size_t> indexes(n);
+  for (size_t& i : indexes) {
+    i = std::lower_bound(cdf.begin(), cdf.end(), uniform(rand)) - cdf.begin();
+    if (i >= range) i = range - 1;
+  }
+  return indexes;
+}
+
+constexpr size_t kLookups = 1 << 20;
+
+// Args: # of elements, % of lookups that hit, and 1 for Zipfian lookups (0
+// for uniform).
+template <typename Adapter>
+void BM_Find(benchmark::State& state) {
+  const size_t n = state.range(0);
+  const int hit_percent = state.range(1);
+  const bool zipf = state.range(2);
+  const std::vector<Key> present = RandomKeys(n, 0);
+  const std::vector<Key> absent = RandomKeys(n, 1);
+  Adapter t(n);
+  for (Key k : present) t.Insert(k, k);
+
+  // Shuffle the ranks so that popular keys are spread over the table.
+  std::vector<size_t> indexes =
+      zipf ? ZipfIndexes(kLookups, n, 0.99, 2) : ZipfIndexes(kLookups, n, 0, 2);
+  std::mt19937_64 rand(3);
+  std::vector<size_t> perm(n);
+  for (size_t i = 0; i < n; i++) perm[i] = i;
+  std::shuffle(perm.begin(), perm.end(), rand);
+  std::vector<Key> lookups(kLookups);
+  for (size_t i = 0; i < kLookups; i++) {
+    const bool hit = static_cast<int>(rand() % 100) < hit_percent;
+    lookups[i] = (hit ? present : absent)[perm[indexes[i]]];
+  }
+
+  size_t i = 0;
+  uint64_t v;
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(t.Find(lookups[i], &v));
+    i = (i + 1) & (kLookups - 1);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Arg: # of elements. Reports the bytes allocated per element once all of
+// them are inserted.
+template <typename Adapter>
+void BM_Insert(benchmark::State& state) {
+  const size_t n = state.range(0);
+  const std::vector<Key> keys = RandomKeys(n, 0);
+  double bytes_per_elem = 0;
+  while (state.KeepRunning()) {
+    Adapter t(n);
+    for (Key k : keys) t.Insert(k, k);
+    bytes_per_elem = static_cast<double>(allocated_bytes) / n;
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  state.counters["bytes_per_elem"] = bytes_per_elem;
+}
+
+void FindArgs(benchmark::internal::Benchmark* b) {
+  for (int n : {1 << 14, 1 << 22}) {
+    for (int hit_percent : {0, 50, 100}) {
+      for (int zipf : {0, 1}) b->Args({n, hit_percent, zipf});
+    }
+  }
+}
+
+BENCHMARK_TEMPLATE(BM_Find, LpAdapter)->Apply(FindArgs);
+BENCHMARK_TEMPLATE(BM_Find, DenseAdapter)->Apply(FindArgs);
+BENCHMARK_TEMPLATE(BM_Find, StdAdapter)->Apply(FindArgs);
+BENCHMARK_TEMPLATE(BM_Insert, LpAdapter)->Arg(1 << 14)->Arg(1 << 22);
+BENCHMARK_TEMPLATE(BM_Insert, DenseAdapter)->Arg(1 << 14)->Arg(1 << 22);
+BENCHMARK_TEMPLATE(BM_Insert, StdAdapter)->Arg(1 << 14)->Arg(1 << 22);
+
+}  // namespace
+
+BENCHMARK_MAIN();
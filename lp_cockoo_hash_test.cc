@@ -1,11 +1,16 @@
 #include <gtest/gtest.h>
 
+#include <atomic>
 #include <chrono>
 #include <iostream>
 #include <limits>
+#include <map>
+#include <memory>
 #include <random>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <type_traits>
 
 #include "lp_cockoo_hash.h"
@@ -39,11 +44,266 @@ struct HashOpts {
   void Init(int hash_index, size_t hash, Key k, Value* v) { v->key = k; }
   bool Equals(size_t hash, Key k, const Value& v) const { return k == v.key; }
   bool Empty(const Value& v) const { return v.key == kEmpty; }
-  bool Clear(Value* v) const { return v->key = kEmpty; }
+  void Clear(Value* v) const { v->key = kEmpty; }
 };
 
 using Table = LpCockooHash<int, Value, HashOpts>;
 
+struct ResizeOpts : HashOpts {
+  static constexpr bool AutoResize = true;
+  static constexpr int MigrateBatch = 4;
+};
+
+using ResizeTable = LpCockooHash<int, Value, ResizeOpts>;
+
+// Maps every key to the same windows, which no resize can spread.
+struct DegenerateOpts : ResizeOpts {
+  size_t Hash(int hash_index, Key k) const { return 0; }
+  size_t Hash(int hash_index, const Value& v) const { return 0; }
+};
+
+template <int Bits>
+struct TagOpts : HashOpts {
+  static constexpr int TagBits = Bits;
+};
+
+struct WideTagResizeOpts : ResizeOpts {
+  static constexpr int BucketWidth = 4;
+  static constexpr int TagBits = 8;
+};
+
+struct ConcurrentOpts : HashOpts {
+  static constexpr bool Concurrent = true;
+  static constexpr int TagBits = 8;
+
+  // Readers may see the element as soon as Init returns, so set the value
+  // here.
+  void Init(int hash_index, size_t hash, Key k, Value* v) {
+    v->key = k;
+    v->value = k + 1;
+  }
+};
+
+// Finalizer of MurmurHash3.
+inline size_t Mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+template <LpCockooHashIndexMode Mode>
+struct IndexOpts : ResizeOpts {
+  static constexpr LpCockooHashIndexMode IndexMode = Mode;
+
+  // kMultiplyShift uses the high bits of the hash, which "k + hash_index"
+  // leaves empty.
+  size_t Hash(int hash_index, Key k) const { return Mix(k * 2 + hash_index); }
+  size_t Hash(int hash_index, const Value& v) const {
+    return Hash(hash_index, v.key);
+  }
+};
+
+template <int Width, int Bits>
+struct AlignedOpts : IndexOpts<LpCockooHashIndexMode::kModulo> {
+  static constexpr LpCockooHashLayout Layout = LpCockooHashLayout::kAligned;
+  static constexpr int BucketWidth = Width;
+  static constexpr int TagBits = Bits;
+};
+
+template <int Width, int Bits>
+struct InterleaveOpts : AlignedOpts<Width, Bits> {
+  static constexpr bool Interleave = true;
+};
+
+// The hash of every key under EdgeOpts.
+size_t edge_hash = 0;
+
+// Puts all keys in the windows that start at bucket edge_hash.
+template <int Width, int Bits>
+struct EdgeOpts : HashOpts {
+  static constexpr int BucketWidth = Width;
+  static constexpr int TagBits = Bits;
+
+  size_t Hash(int hash_index, Key k) const { return edge_hash; }
+  size_t Hash(int hash_index, const Value& v) const { return edge_hash; }
+};
+
+// Counts calls to Hash(n, ...) with n > 0, which PartialKey never makes.
+std::atomic<int> other_hash_calls(0);
+
+template <int Bits>
+struct PartialKeyOpts : IndexOpts<LpCockooHashIndexMode::kPowerOfTwo> {
+  static constexpr LpCockooHashLayout Layout = LpCockooHashLayout::kAligned;
+  static constexpr int BucketWidth = 4;
+  static constexpr int TagBits = Bits;
+  static constexpr bool PartialKey = true;
+
+  size_t Hash(int hash_index, Key k) const {
+    if (hash_index > 0) other_hash_calls++;
+    return Mix(k);
+  }
+  size_t Hash(int hash_index, const Value& v) const {
+    return Hash(hash_index, v.key);
+  }
+};
+
+template <int N, LpCockooHashIndexMode Mode>
+struct SingleHashOpts : IndexOpts<Mode> {
+  static constexpr int NumHashes = N;
+  static constexpr bool SingleHash = true;
+
+  size_t Hash(int hash_index, Key k) const {
+    if (hash_index > 0) other_hash_calls++;
+    return Mix(k);
+  }
+  size_t Hash(int hash_index, const Value& v) const {
+    return Hash(hash_index, v.key);
+  }
+};
+
+struct CountingConcurrentOpts : ConcurrentOpts {
+  size_t Hash(int hash_index, Key k) const {
+    if (hash_index > 0) other_hash_calls++;
+    return k + hash_index;
+  }
+  size_t Hash(int hash_index, const Value& v) const {
+    return Hash(hash_index, v.key);
+  }
+};
+
+template <typename Base>
+struct FixedSizeOpts : Base {
+  static constexpr bool AutoResize = false;
+};
+
+template <int Depth>
+struct SearchBoundOpts : IndexOpts<LpCockooHashIndexMode::kModulo> {
+  static constexpr bool AutoResize = false;
+  static constexpr int MaxSearchNodes = 20;
+  static constexpr int MaxSearchDepth = Depth;
+};
+
+template <LpCockooHashEviction E, int N>
+struct EvictionOpts : IndexOpts<LpCockooHashIndexMode::kModulo> {
+  static constexpr int NumHashes = N;
+  static constexpr LpCockooHashEviction Eviction = E;
+
+  size_t Hash(int hash_index, Key k) const { return Mix(k * N + hash_index); }
+  size_t Hash(int hash_index, const Value& v) const {
+    return Hash(hash_index, v.key);
+  }
+};
+
+struct ConcurrentPartialKeyOpts : PartialKeyOpts<16> {
+  static constexpr bool AutoResize = false;
+  static constexpr bool Concurrent = true;
+
+  void Init(int hash_index, size_t hash, Key k, Value* v) {
+    v->key = k;
+    v->value = k + 1;
+  }
+};
+
+// Counts calls to Hash(n, Value), which StoreHash makes only for elements
+// in the stash.
+int value_hash_calls = 0;
+
+// Counts calls to Equals and Empty, which tags should spare a probe that
+// misses.
+int equals_calls = 0;
+int empty_calls = 0;
+
+template <int Bits>
+struct CountingTagOpts : TagOpts<Bits> {
+  size_t Hash(int hash_index, Key k) const { return Mix(k * 2 + hash_index); }
+  size_t Hash(int hash_index, const Value& v) const {
+    return Hash(hash_index, v.key);
+  }
+  bool Equals(size_t hash, Key k, const Value& v) const {
+    equals_calls++;
+    return k == v.key;
+  }
+  bool Empty(const Value& v) const {
+    empty_calls++;
+    return v.key == kEmpty;
+  }
+};
+
+template <typename Base>
+struct StoreHashOpts : Base {
+  static constexpr bool StoreHash = true;
+
+  size_t Hash(int hash_index, Key k) const { return Base::Hash(hash_index, k); }
+  size_t Hash(int hash_index, const Value& v) {
+    value_hash_calls++;
+    return Base::Hash(hash_index, v.key);
+  }
+};
+
+struct HugePageOpts : HashOpts {
+  LpCockooHashHugePageAlloc<Value> pages;
+  Value* Alloc(int n) { return pages.Alloc(n); }
+  void Free(Value* array, int n) { pages.Free(array, n); }
+};
+
+// Adds an Init overload that sets the value, for try_emplace and
+// insert_or_assign.
+template <typename Base>
+struct EmplaceOpts : Base {
+  using Base::Init;
+  void Init(int hash_index, size_t hash, Key k, Value* v, int value) {
+    v->key = k;
+    v->value = value;
+  }
+};
+
+// A value that cannot be copied.
+struct MoveOnlyValue {
+  Key key = kEmpty;
+  std::unique_ptr<std::string> name;
+};
+
+struct MoveOnlyOpts {
+  static constexpr int NumHashes = 2;
+  static constexpr int BucketWidth = 4;
+  static constexpr bool AutoResize = true;
+  static constexpr int MigrateBatch = 4;
+  static constexpr int TagBits = 8;
+
+  MoveOnlyValue* Alloc(int n) { return new MoveOnlyValue[n](); }
+  void Free(MoveOnlyValue* array, int n) { delete[] array; }
+
+  size_t Hash(int hash_index, Key k) const { return Mix(k * 2 + hash_index); }
+  size_t Hash(int hash_index, const MoveOnlyValue& v) const {
+    return Hash(hash_index, v.key);
+  }
+
+  void Init(int hash_index, size_t hash, Key k, MoveOnlyValue* v) {
+    v->key = k;
+  }
+  void Init(int hash_index, size_t hash, Key k, MoveOnlyValue* v,
+            std::unique_ptr<std::string> name) {
+    v->key = k;
+    v->name = std::move(name);
+  }
+  bool Equals(size_t hash, Key k, const MoveOnlyValue& v) const {
+    return k == v.key;
+  }
+  bool Empty(const MoveOnlyValue& v) const { return v.key == kEmpty; }
+  void Clear(MoveOnlyValue* v) const {
+    v->key = kEmpty;
+    v->name.reset();
+  }
+};
+
+struct TraceOpts : HashOpts {
+  LpCockooHashTraceBuffer* buf;
+  void Trace(const LpCockooHashTraceEvent& e) { buf->Trace(e); }
+};
+
 }  // namespace
 
 TEST(CockooTest, Basic) {
@@ -70,6 +330,895 @@ TEST(CockooTest, Basic) {
   }
 }
 
+TEST(CockooTest, AutoResize) {
+  ResizeTable t(4);
+  const size_t initial_buckets = t.buckets_per_table();
+
+  std::mt19937 rand(0);
+  bool saw_resizing = false;
+  for (int i = 0; i < 1000; i++) {
+    int k = rand() % 1000000;
+    auto p = t.insert(k);
+    ASSERT_FALSE(p.first == t.end());
+    p.first->value = k + 1;
+    saw_resizing |= t.resizing();
+
+    // Elements must stay visible while they are being migrated.
+    auto it = t.find(k);
+    ASSERT_FALSE(it == t.end());
+    ASSERT_EQ(it->value, k + 1);
+  }
+  EXPECT_TRUE(saw_resizing);
+  EXPECT_GT(t.buckets_per_table(), initial_buckets);
+
+  rand = std::mt19937(0);
+  for (int i = 0; i < 1000; i++) {
+    int k = rand() % 1000000;
+    auto it = t.find(k);
+    ASSERT_FALSE(it == t.end());
+    ASSERT_EQ(it->value, k + 1);
+    ASSERT_EQ(it->key, k);
+  }
+}
+
+TEST(CockooTest, DegenerateHash) {
+  LpCockooHash<int, Value, DegenerateOpts> t(10);
+  const size_t initial_buckets = t.buckets_per_table();
+  std::vector<int> inserted;
+  for (int k = 0; k < 1000; k++) {
+    if (t.insert(k).second) inserted.push_back(k);
+  }
+  // Two windows of 2 slots and the stash hold 8 elements. A stuck resize
+  // keeps a few more in the old tables.
+  EXPECT_GE(inserted.size(), 8u);
+  EXPECT_LT(inserted.size(), 16u);
+  // The growth stops after a few failed resizes instead of going on until
+  // memory runs out.
+  EXPECT_GT(t.buckets_per_table(), initial_buckets);
+  EXPECT_LE(t.buckets_per_table(), initial_buckets << 6);
+  for (int k : inserted) ASSERT_FALSE(t.find(k) == t.end()) << k;
+
+  // Erasing makes room again, first for the elements left in the old
+  // tables.
+  const size_t kept = inserted.size() / 2;
+  for (size_t i = kept; i < inserted.size(); i++) {
+    ASSERT_EQ(t.erase(inserted[i]), 1u);
+    EXPECT_TRUE(t.find(inserted[i]) == t.end());
+  }
+  inserted.resize(kept);
+  EXPECT_TRUE(t.insert(1000).second);
+  inserted.push_back(1000);
+  size_t n = 0;
+  for (auto it = t.begin(); it != t.end(); ++it) n++;
+  EXPECT_EQ(n, inserted.size());
+  for (int k : inserted) ASSERT_FALSE(t.find(k) == t.end()) << k;
+}
+
+TEST(CockooTest, StashAndFull) {
+  Table t(12);
+
+  std::mt19937 rand(0);
+  std::vector<int> keys;
+  for (;;) {
+    int k = rand() % 1000000;
+    auto p = t.insert(k);
+    if (p.first == t.end()) {
+      ASSERT_FALSE(p.second);
+      break;
+    }
+    if (!p.second) continue;
+    p.first->value = k + 1;
+    keys.push_back(k);
+  }
+  // The table is full only after the stash has filled up.
+  const int stash_size = Table::StashSize;
+  EXPECT_EQ(t.stash_size(), stash_size);
+  EXPECT_GT(keys.size(), 2 * t.buckets_per_table());
+
+  for (int k : keys) {
+    auto it = t.find(k);
+    ASSERT_FALSE(it == t.end());
+    ASSERT_EQ(it->value, k + 1);
+  }
+
+  // Erasing an element makes room for it again.
+  auto it = t.find(keys.back());
+  t.erase(it);
+  EXPECT_TRUE(t.find(keys.back()) == t.end());
+  EXPECT_TRUE(t.insert(keys.back()).second);
+}
+
+TEST(CockooTest, Trace) {
+  LpCockooHashTraceBuffer buf;
+  TraceOpts opts;
+  opts.buf = &buf;
+  LpCockooHash<int, Value, TraceOpts> t(12, opts);
+
+  std::mt19937 rand(0);
+  int inserted = 0;
+  for (int i = 0; i < 14; i++) {
+    inserted += t.insert(rand() % 1000000).second;
+  }
+  int inserts = 0, swaps = 0, vacates = 0;
+  for (const LpCockooHashTraceEvent& e : buf.events()) {
+    inserts += e.type == LpCockooHashTraceEvent::kInsert;
+    swaps += e.type == LpCockooHashTraceEvent::kSwap;
+    vacates += e.type == LpCockooHashTraceEvent::kVacate;
+  }
+  EXPECT_EQ(inserts, inserted);
+  // Each eviction chain has at least one swap and ends with a vacated slot.
+  EXPECT_GT(vacates, 0);
+  EXPECT_GE(swaps, vacates);
+  EXPECT_NE(buf.DebugString().find("Insert: "), std::string::npos);
+}
+
+TEST(CockooTest, FindBatch) {
+  ResizeTable t(16);
+  std::mt19937 rand(0);
+  std::vector<int> keys;
+  for (int i = 0; i < 500; i++) {
+    int k = rand() % 1000000;
+    t.insert(k).first->value = k + 1;
+    keys.push_back(k);
+    keys.push_back(k + 1000000);  // Not in the table.
+  }
+
+  std::vector<ResizeTable::iterator> out(keys.size());
+  t.find_batch(keys.data(), keys.size(), out.data());
+  for (size_t i = 0; i < keys.size(); i++) {
+    ASSERT_TRUE(out[i] == t.find(keys[i]));
+    if (keys[i] < 1000000) {
+      ASSERT_EQ(out[i]->value, keys[i] + 1);
+    }
+  }
+}
+
+template <typename T>
+void TestInsertFindErase() {
+  T t(1000);
+  std::mt19937 rand(0);
+  std::vector<int> keys;
+  for (int i = 0; i < 1000; i++) {
+    int k = rand() % 1000000;
+    auto p = t.insert(k);
+    if (p.first == t.end()) break;
+    if (!p.second) continue;
+    p.first->value = k + 1;
+    keys.push_back(k);
+  }
+  for (size_t i = 0; i < keys.size(); i++) {
+    auto it = t.find(keys[i]);
+    ASSERT_FALSE(it == t.end());
+    ASSERT_EQ(it->value, keys[i] + 1);
+    ASSERT_TRUE(t.find(keys[i] + 1000000) == t.end());
+    if (i % 2 == 0) t.erase(it);
+  }
+  for (size_t i = 0; i < keys.size(); i++) {
+    ASSERT_EQ(t.find(keys[i]) == t.end(), i % 2 == 0);
+  }
+}
+
+// Inserts up to 1000 random keys into "t", stopping when it is full.
+// Returns the keys in the table.
+template <typename T>
+std::set<int> FillRandom(T* t) {
+  std::mt19937 rand(0);
+  std::set<int> keys;
+  for (int i = 0; i < 1000; i++) {
+    const int k = rand() % 1000000;
+    if (t->insert(k).first == t->end()) break;
+    keys.insert(k);
+  }
+  return keys;
+}
+
+// Checks that iteration visits each key once, also while erasing.
+template <typename T>
+void TestIterate() {
+  T t(1000);
+  const std::set<int> keys = FillRandom(&t);
+  std::set<int> seen;
+  for (auto it = t.begin(); it != t.end(); ++it) {
+    EXPECT_TRUE(seen.insert(it->key).second) << it->key;
+  }
+  EXPECT_EQ(seen, keys);
+
+  std::set<int> even;
+  for (auto it = t.begin(); it != t.end(); it++) {
+    if (it->key % 2 != 0) {
+      t.erase(it);
+    } else {
+      even.insert(it->key);
+    }
+  }
+  seen.clear();
+  for (auto it = t.begin(); it != t.end(); ++it) seen.insert(it->key);
+  EXPECT_EQ(seen, even);
+}
+
+TEST(CockooTest, Iterate) {
+  TestIterate<Table>();
+  TestIterate<ResizeTable>();
+  TestIterate<LpCockooHash<int, Value, TagOpts<8>>>();
+  TestIterate<LpCockooHash<int, Value, TagOpts<16>>>();
+  TestIterate<LpCockooHash<int, Value, WideTagResizeOpts>>();
+  TestIterate<LpCockooHash<int, Value, InterleaveOpts<4, 8>>>();
+
+  LpCockooHash<int, Value, TagOpts<8>> empty(1000);
+  EXPECT_TRUE(empty.begin() == empty.end());
+}
+
+template <typename T>
+void TestParallelForEach() {
+  T t(1000);
+  const std::set<int> keys = FillRandom(&t);
+
+  // Small ranges, each split in two, must still cover every element once.
+  // Without Interleave, two ranges of one table share no cache line.
+  std::multiset<int> seen;
+  std::map<std::pair<int, uintptr_t>, int> line_range;
+  bool shared = false;
+  int id = 0;
+  auto visit = [&](const Value& v, int table) {
+    seen.insert(v.key);
+    const auto line =
+        std::make_pair(table, reinterpret_cast<uintptr_t>(&v) / 64);
+    auto p = line_range.insert(std::make_pair(line, id));
+    if (!p.second && p.first->second != id) shared = true;
+  };
+  for (auto r : t.ranges(10)) {
+    decltype(r) r2{};
+    const bool split = r.split(&r2);
+    EXPECT_TRUE(!split || r.end == r2.begin);
+    id++;
+    r.for_each([&](Value& v) { visit(v, r.table); });
+    id++;
+    if (split) r2.for_each([&](Value& v) { visit(v, r2.table); });
+  }
+  EXPECT_EQ(seen, std::multiset<int>(keys.begin(), keys.end()));
+  EXPECT_TRUE(T::Interleave || !shared);
+
+  std::atomic<int> n(0);
+  std::atomic<int64_t> sum(0);
+  t.parallel_for_each(
+      [&](Value& v) {
+        n++;
+        sum += v.key;
+      },
+      4);
+  int64_t want = 0;
+  for (int k : keys) want += k;
+  EXPECT_EQ(n.load(), keys.size());
+  EXPECT_EQ(sum.load(), want);
+}
+
+TEST(CockooTest, ParallelForEach) {
+  TestParallelForEach<Table>();
+  TestParallelForEach<ResizeTable>();
+  TestParallelForEach<LpCockooHash<int, Value, WideTagResizeOpts>>();
+  TestParallelForEach<LpCockooHash<int, Value, InterleaveOpts<4, 8>>>();
+}
+
+template <typename T>
+void TestEraseByKey() {
+  T t(1000);
+  const std::set<int> keys = FillRandom(&t);
+  std::set<int> left;
+  for (int k : keys) {
+    if (k % 3 == 0) {
+      EXPECT_EQ(t.erase(k), 1);
+      EXPECT_EQ(t.erase(k), 0);
+    } else {
+      left.insert(k);
+    }
+  }
+  EXPECT_EQ(t.erase(1000001), 0);
+
+  size_t odd = 0;
+  for (int k : left) odd += k % 2;
+  EXPECT_EQ(t.erase_if([](const Value& v) { return v.key % 2 != 0; }), odd);
+  for (int k : keys) {
+    EXPECT_EQ(t.find(k) == t.end(), k % 3 == 0 || k % 2 != 0) << k;
+  }
+  EXPECT_EQ(t.erase_if([](const Value& v) { return true; }), left.size() - odd);
+  EXPECT_TRUE(t.begin() == t.end());
+}
+
+TEST(CockooTest, EraseByKey) {
+  TestEraseByKey<Table>();
+  TestEraseByKey<ResizeTable>();
+  TestEraseByKey<LpCockooHash<int, Value, WideTagResizeOpts>>();
+  TestEraseByKey<LpCockooHash<int, Value, ConcurrentOpts>>();
+}
+
+// Erases most of a large table, shrinks it, and checks that the remaining
+// keys are found while and after their slots move.
+template <typename T>
+void TestShrink(int elems) {
+  T t(elems);
+  std::vector<int> keys;
+  for (int k = 0; k < elems; k++) {
+    ASSERT_TRUE(t.insert(k).second);
+    keys.push_back(k);
+  }
+  t.migrate(std::numeric_limits<size_t>::max());
+  const size_t peak = t.buckets_per_table();
+  t.erase_if([](const Value& v) { return v.key % 20 != 0; });
+
+  t.shrink_to_fit();
+  EXPECT_LT(t.buckets_per_table(), peak / 4);
+  for (int k : keys) ASSERT_EQ(t.find(k) == t.end(), k % 20 != 0) << k;
+  // Inserts move the rest of the elements. The shrunk tables have room for
+  // as many again without AutoResize.
+  for (int k = elems; k < elems + elems / 20; k++) {
+    ASSERT_TRUE(t.insert(k).second);
+    keys.push_back(k);
+  }
+  t.migrate(std::numeric_limits<size_t>::max());
+  EXPECT_FALSE(t.resizing());
+  for (int k : keys) {
+    ASSERT_EQ(t.find(k) == t.end(), k < elems && k % 20 != 0) << k;
+  }
+
+  t.rehash(4 * elems);
+  EXPECT_GE(t.buckets_per_table(), peak);
+  for (int k : keys) {
+    ASSERT_EQ(t.find(k) == t.end(), k < elems && k % 20 != 0) << k;
+  }
+}
+
+TEST(CockooTest, Shrink) {
+  TestShrink<ResizeTable>(10000);
+  TestShrink<LpCockooHash<int, Value, WideTagResizeOpts>>(10000);
+  TestShrink<
+      LpCockooHash<int, Value, IndexOpts<LpCockooHashIndexMode::kPowerOfTwo>>>(
+      10000);
+  TestShrink<LpCockooHash<int, Value, ConcurrentPartialKeyOpts>>(10000);
+
+  // A table that was grown shrinks too, and an empty one stays usable.
+  ResizeTable t(10);
+  for (int k = 0; k < 1000; k++) ASSERT_TRUE(t.insert(k).second);
+  t.erase_if([](const Value& v) { return true; });
+  t.shrink_to_fit();
+  t.migrate(std::numeric_limits<size_t>::max());
+  EXPECT_TRUE(t.begin() == t.end());
+  ASSERT_TRUE(t.insert(5).second);
+  EXPECT_FALSE(t.find(5) == t.end());
+}
+
+template <typename T>
+void TestEmplace() {
+  T t(4000);
+  for (int k = 0; k < 2000; k++) {
+    auto p = t.try_emplace(k, 3 * k);
+    ASSERT_TRUE(p.second);
+    ASSERT_EQ(p.first->value, 3 * k);
+  }
+  // try_emplace leaves an existing value alone; insert_or_assign replaces
+  // it.
+  for (int k = 0; k < 2000; k++) {
+    auto p = t.try_emplace(k, -1);
+    ASSERT_FALSE(p.second);
+    ASSERT_EQ(p.first->value, 3 * k);
+  }
+  for (int k = 0; k < 2000; k += 2) {
+    ASSERT_FALSE(t.insert_or_assign(k, 5 * k).second);
+  }
+  auto p = t.insert_or_assign(2000, 7);
+  ASSERT_TRUE(p.second);
+  EXPECT_EQ(p.first->value, 7);
+  for (int k = 0; k < 2000; k++) {
+    auto it = t.find(k);
+    ASSERT_FALSE(it == t.end());
+    ASSERT_EQ(it->value, k % 2 == 0 ? 5 * k : 3 * k) << k;
+  }
+}
+
+TEST(CockooTest, Emplace) {
+  TestEmplace<LpCockooHash<int, Value, EmplaceOpts<ResizeOpts>>>();
+  TestEmplace<LpCockooHash<int, Value, EmplaceOpts<WideTagResizeOpts>>>();
+  TestEmplace<LpCockooHash<int, Value, EmplaceOpts<ConcurrentOpts>>>();
+  TestEmplace<
+      LpCockooHash<int, Value, EmplaceOpts<ConcurrentPartialKeyOpts>>>();
+}
+
+TEST(CockooTest, MoveOnlyValue) {
+  using Name = std::unique_ptr<std::string>;
+  // Starts small so that the elements are evicted, stashed and migrated.
+  LpCockooHash<int, MoveOnlyValue, MoveOnlyOpts> t(16);
+  for (int k = 0; k < 5000; k++) {
+    Name name(new std::string(std::to_string(k)));
+    ASSERT_TRUE(t.try_emplace(k, std::move(name)).second);
+    ASSERT_TRUE(name == nullptr);
+  }
+  uint64_t evicting = 0;
+  for (int moves = 1; moves <= t.MaxSearchDepth; moves++) {
+    evicting += t.inserts_with_moves(moves);
+  }
+  EXPECT_GT(evicting, 0u);
+
+  // "name" is not consumed when the key exists.
+  Name name(new std::string("x"));
+  EXPECT_FALSE(t.try_emplace(1, std::move(name)).second);
+  EXPECT_TRUE(name != nullptr);
+  EXPECT_FALSE(t.insert_or_assign(1, std::move(name)).second);
+  EXPECT_TRUE(name == nullptr);
+
+  t.migrate(std::numeric_limits<size_t>::max());
+  for (int k = 0; k < 5000; k++) {
+    auto it = t.find(k);
+    ASSERT_FALSE(it == t.end());
+    ASSERT_EQ(*it->name, k == 1 ? "x" : std::to_string(k));
+  }
+}
+
+// Looks up absent keys in a half-full table, and checks that only the slots
+// whose tag matches are read.
+template <int Bits>
+void TestTagMisses(int max_equals) {
+  LpCockooHash<int, Value, CountingTagOpts<Bits>> t(10000);
+  const int n = t.slots_per_table();
+  for (int k = 0; k < n; k++) ASSERT_FALSE(t.insert(k * 7).first == t.end());
+  ASSERT_EQ(t.stash_size(), 0);
+  equals_calls = 0;
+  empty_calls = 0;
+  const int kLookups = 10000;
+  for (int i = 0; i < kLookups; i++) {
+    ASSERT_TRUE(t.find(i * 7 + 3) == t.end());
+  }
+  // Each lookup probes 2 windows of 2 slots, half of them occupied.
+  EXPECT_LE(equals_calls, max_equals);
+  EXPECT_EQ(empty_calls, 0);
+}
+
+TEST(CockooTest, Tags) {
+  TestInsertFindErase<LpCockooHash<int, Value, TagOpts<8>>>();
+  TestInsertFindErase<LpCockooHash<int, Value, TagOpts<16>>>();
+  TestInsertFindErase<LpCockooHash<int, Value, WideTagResizeOpts>>();
+
+  // About 2 of the 4 probed slots are occupied, and a stale or colliding
+  // tag matches 1 / 255 (8 bits) or 1 / 65535 (16 bits) of them.
+  TestTagMisses<8>(10000 / 20);
+  TestTagMisses<16>(5);
+}
+
+// Checks that every element of the current tables of "t" is in the window
+// that start(hash, buckets) gives for its table. The opts of "T" must hash
+// with Mix(k * 2 + hash_index).
+template <typename T, typename Start>
+void ExpectInWindows(T& t, Start start) {
+  t.migrate(std::numeric_limits<size_t>::max());
+  int checked = 0;
+  for (auto it = t.begin(); it != t.end(); ++it) {
+    if (it.table >= T::NumHashes) continue;  // The stash.
+    const size_t first =
+        start(Mix(it->key * 2 + it.table), t.buckets_per_table());
+    ASSERT_GE(it.index, first) << it->key;
+    ASSERT_LT(it.index, first + T::BucketWidth) << it->key;
+    checked++;
+  }
+  EXPECT_GT(checked, 0);
+}
+
+template <LpCockooHashIndexMode Mode, typename Start>
+void TestIndexMode(Start start) {
+  LpCockooHash<int, Value, IndexOpts<Mode>> t(100);
+  for (int k = 0; k < 1000; k++) ASSERT_FALSE(t.insert(k).first == t.end());
+  ExpectInWindows(t, start);
+}
+
+TEST(CockooTest, IndexMode) {
+  TestInsertFindErase<
+      LpCockooHash<int, Value, IndexOpts<LpCockooHashIndexMode::kModulo>>>();
+  TestInsertFindErase<LpCockooHash<
+      int, Value, IndexOpts<LpCockooHashIndexMode::kMultiplyShift>>>();
+  TestInsertFindErase<LpCockooHash<
+      int, Value, IndexOpts<LpCockooHashIndexMode::kPowerOfTwo>>>();
+
+  // Power-of-two tables stay that way as they grow.
+  LpCockooHash<int, Value, IndexOpts<LpCockooHashIndexMode::kPowerOfTwo>> t(
+      100);
+  for (int k = 0; k < 1000; k++) {
+    ASSERT_FALSE(t.insert(k).first == t.end());
+    const size_t buckets = t.buckets_per_table();
+    ASSERT_EQ(buckets & (buckets - 1), 0u);
+  }
+  EXPECT_GT(t.buckets_per_table(), 100u);
+  for (int k = 0; k < 1000; k++) ASSERT_FALSE(t.find(k) == t.end());
+
+  // Each mode reduces the hash as documented.
+  TestIndexMode<LpCockooHashIndexMode::kModulo>(
+      [](size_t hash, size_t buckets) { return hash % buckets; });
+  TestIndexMode<LpCockooHashIndexMode::kMultiplyShift>(
+      [](size_t hash, size_t buckets) {
+        return static_cast<size_t>(
+            (static_cast<unsigned __int128>(hash) * buckets) >> 64);
+      });
+  TestIndexMode<LpCockooHashIndexMode::kPowerOfTwo>(
+      [](size_t hash, size_t buckets) { return hash & (buckets - 1); });
+}
+
+TEST(CockooTest, AlignedLayout) {
+  TestInsertFindErase<LpCockooHash<int, Value, AlignedOpts<2, 0>>>();
+  TestInsertFindErase<LpCockooHash<int, Value, AlignedOpts<4, 8>>>();
+
+  LpCockooHash<int, Value, AlignedOpts<4, 0>> t(100);
+  EXPECT_EQ(t.slots_per_table(), 4 * t.buckets_per_table());
+  for (int k = 0; k < 1000; k++) {
+    auto it = t.insert(k).first;
+    ASSERT_FALSE(it == t.end());
+  }
+  for (int k = 0; k < 1000; k++) ASSERT_FALSE(t.find(k) == t.end());
+  // After the evictions and resizes, every element is still in the aligned
+  // window of its table.
+  ExpectInWindows(t, [](size_t hash, size_t buckets) {
+    return hash % buckets * 4;
+  });
+}
+
+TEST(CockooTest, Interleave) {
+  TestInsertFindErase<LpCockooHash<int, Value, InterleaveOpts<2, 0>>>();
+  TestInsertFindErase<LpCockooHash<int, Value, InterleaveOpts<4, 8>>>();
+  TestIterate<LpCockooHash<int, Value, InterleaveOpts<2, 16>>>();
+
+  // Bucket b of table hi is bucket b * 2 + hi of one array.
+  using T = LpCockooHash<int, Value, InterleaveOpts<4, 0>>;
+  T t(100);
+  T::iterator first = {&t, 0, 0};
+  for (size_t b = 0; b < t.buckets_per_table(); b++) {
+    for (int hi = 0; hi < 2; hi++) {
+      for (size_t i = 0; i < 4; i++) {
+        T::iterator it = {&t, hi, b * 4 + i};
+        ASSERT_EQ(&*it - &*first, static_cast<ptrdiff_t>((b * 2 + hi) * 4 + i));
+      }
+    }
+  }
+}
+
+// Fills, looks up and empties the windows that start in the last Width
+// buckets, which reach into the Width - 1 tail slots of each table.
+template <int Width, int Bits>
+void TestEdgeWindows() {
+  using T = LpCockooHash<int, Value, EdgeOpts<Width, Bits>>;
+  for (int d = 1; d <= Width; d++) {
+    T t(100);
+    ASSERT_EQ(t.slots_per_table(), t.buckets_per_table() + Width - 1);
+    const size_t first = t.buckets_per_table() - d;
+    edge_hash = first;
+    const int num_hashes = T::NumHashes;
+    const int n = num_hashes * Width;
+    for (int k = 0; k < n; k++) {
+      const auto it = t.insert(k).first;
+      ASSERT_FALSE(it == t.end()) << d << " " << k;
+      ASSERT_LT(it.table, num_hashes);
+      ASSERT_GE(it.index, first);
+      ASSERT_LT(it.index, first + Width);
+    }
+    for (int k = 0; k < n; k++) {
+      auto it = t.find(k);
+      ASSERT_FALSE(it == t.end()) << d << " " << k;
+      EXPECT_EQ(it->key, k);
+    }
+    EXPECT_TRUE(t.find(n) == t.end());
+    for (int k = 0; k < n; k++) ASSERT_EQ(t.erase(k), 1u);
+    for (int k = 0; k < n; k++) ASSERT_TRUE(t.find(k) == t.end());
+    EXPECT_TRUE(t.begin() == t.end());
+  }
+}
+
+TEST(CockooTest, EdgeWindows) {
+  TestEdgeWindows<2, 0>();
+  TestEdgeWindows<4, 0>();
+  TestEdgeWindows<4, 8>();
+  TestEdgeWindows<8, 16>();
+}
+
+TEST(CockooTest, AllocLimit) {
+  // The tables would need more than INT_MAX slots, which Alloc cannot take.
+  EXPECT_THROW(Table t(size_t{1} << 31), std::bad_alloc);
+}
+
+TEST(CockooTest, HugePageAlloc) {
+  // Large enough for the tables to be mmap'ed.
+  LpCockooHash<int, Value, HugePageOpts> t(1 << 20);
+  std::mt19937 rand(0);
+  std::vector<int> keys;
+  for (int i = 0; i < 10000; i++) {
+    int k = rand() % 1000000;
+    auto p = t.insert(k);
+    ASSERT_FALSE(p.first == t.end());
+    p.first->value = k + 1;
+    if (p.second) keys.push_back(k);
+  }
+  for (int k : keys) {
+    auto it = t.find(k);
+    ASSERT_FALSE(it == t.end());
+    ASSERT_EQ(it->value, k + 1);
+    t.erase(it);
+  }
+  for (int k : keys) ASSERT_TRUE(t.find(k) == t.end());
+}
+
+TEST(CockooTest, SearchBounds) {
+  LpCockooHash<int, Value, SearchBoundOpts<2>> t(1000);
+  const int slots = 2 * t.slots_per_table();
+  int inserted = 0;
+  for (int k = 0; k < slots && t.insert(k).first != t.end(); k++) inserted++;
+  EXPECT_GT(inserted, slots / 2);
+  uint64_t counted = t.stash_size();
+  for (int moves = 0; moves <= 2; moves++) {
+    counted += t.inserts_with_moves(moves);
+  }
+  EXPECT_EQ(counted, inserted);
+  EXPECT_GT(t.inserts_with_moves(1), 0);
+  EXPECT_GT(t.inserts_with_moves(2), 0);
+}
+
+// Fills a fixed-size table until an insert fails, and checks that every key
+// is still there. Returns the final load.
+template <typename Opts>
+double FillUntilFull() {
+  LpCockooHash<int, Value, FixedSizeOpts<Opts>> t(10000);
+  const size_t slots = Opts::NumHashes * t.slots_per_table();
+  std::vector<int> keys;
+  for (int k = 0; t.insert(k).first != t.end(); k++) keys.push_back(k);
+  for (int k : keys) EXPECT_FALSE(t.find(k) == t.end()) << k;
+  return static_cast<double>(keys.size()) / slots;
+}
+
+// Fills a fixed-size table to 90% and returns the mean number of elements
+// that the inserts moved.
+template <typename Opts>
+double MeanMoves() {
+  LpCockooHash<int, Value, FixedSizeOpts<Opts>> t(10000);
+  const size_t slots = Opts::NumHashes * t.slots_per_table();
+  for (int k = 0; k < slots * 0.9; k++) {
+    EXPECT_FALSE(t.insert(k).first == t.end());
+  }
+  uint64_t inserts = 0;
+  uint64_t moves = 0;
+  for (int m = 0; m <= t.MaxSearchDepth; m++) {
+    inserts += t.inserts_with_moves(m);
+    moves += m * t.inserts_with_moves(m);
+  }
+  return static_cast<double>(moves) / inserts;
+}
+
+template <LpCockooHashEviction E>
+void TestEviction() {
+  TestInsertFindErase<LpCockooHash<int, Value, EvictionOpts<E, 2>>>();
+  TestInsertFindErase<LpCockooHash<int, Value, EvictionOpts<E, 3>>>();
+  EXPECT_GT((FillUntilFull<EvictionOpts<E, 2>>()), 0.85);
+  EXPECT_GT((FillUntilFull<EvictionOpts<E, 3>>()), 0.93);
+}
+
+TEST(CockooTest, Eviction) {
+  TestEviction<LpCockooHashEviction::kBfs>();
+  TestEviction<LpCockooHashEviction::kRandomWalk>();
+  TestEviction<LpCockooHashEviction::kHybrid>();
+
+  // The BFS finds shortest chains. The random walk finds longer ones, and
+  // kHybrid uses the BFS for the short chains that most inserts need.
+  const double bfs = MeanMoves<EvictionOpts<LpCockooHashEviction::kBfs, 3>>();
+  const double walk =
+      MeanMoves<EvictionOpts<LpCockooHashEviction::kRandomWalk, 3>>();
+  const double hybrid =
+      MeanMoves<EvictionOpts<LpCockooHashEviction::kHybrid, 3>>();
+  EXPECT_LT(bfs, walk);
+  EXPECT_LT(hybrid, walk);
+}
+
+TEST(CockooTest, ConcurrentFind) {
+  const int kKeys = 20000;
+  LpCockooHash<int, Value, ConcurrentOpts> t(4 * kKeys);
+  std::mt19937 rand(0);
+  std::vector<int> keys;
+  for (int i = 0; i < kKeys; i++) keys.push_back(rand() % 1000000);
+
+  std::atomic<int> published(0);
+  std::atomic<bool> failed(false);
+  // Set when the writer is done, even if an insert failed.
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 4; r++) {
+    readers.emplace_back([&, r]() {
+      std::mt19937 rand(r);
+      Value v;
+      while (!stop.load()) {
+        const int n = published.load();
+        if (n == 0) continue;
+        const int k = keys[rand() % n];
+        if (!t.find(k, &v) || v.key != k || v.value != k + 1) failed = true;
+        if (t.find(k + 1000000, &v)) failed = true;
+      }
+    });
+  }
+  bool inserted = true;
+  for (int i = 0; i < kKeys && inserted; i++) {
+    inserted = t.insert(keys[i]).first != t.end();
+    if (inserted) published.store(i + 1);
+  }
+  stop = true;
+  for (std::thread& th : readers) th.join();
+  EXPECT_TRUE(inserted);
+  EXPECT_FALSE(failed.load());
+}
+
+TEST(CockooTest, LazyHash) {
+  // An empty table places a new key in table 0, so finding it needs only the
+  // first hash.
+  LpCockooHash<int, Value, CountingConcurrentOpts> t(100);
+  ASSERT_TRUE(t.insert(5).second);
+  other_hash_calls = 0;
+  Value v;
+  EXPECT_TRUE(t.find(5, &v));
+  EXPECT_FALSE(t.find(5) == t.end());
+  EXPECT_EQ(other_hash_calls.load(), 0);
+  EXPECT_FALSE(t.find(6, &v));
+  EXPECT_EQ(other_hash_calls.load(), 1);
+}
+
+TEST(CockooTest, PartialKey) {
+  other_hash_calls = 0;
+  TestInsertFindErase<LpCockooHash<int, Value, PartialKeyOpts<8>>>();
+  TestInsertFindErase<LpCockooHash<int, Value, PartialKeyOpts<16>>>();
+  EXPECT_EQ(other_hash_calls.load(), 0);
+
+  // Fill a fixed-size table to a high load so that inserts evict.
+  LpCockooHash<int, Value, ConcurrentPartialKeyOpts> t(10000);
+  const size_t slots = 2 * t.slots_per_table();
+  std::vector<int> keys;
+  for (int k = 0; keys.size() < slots * 0.9; k++) {
+    ASSERT_FALSE(t.insert(k).first == t.end());
+    keys.push_back(k);
+  }
+  for (int k : keys) ASSERT_FALSE(t.find(k) == t.end());
+  EXPECT_EQ(other_hash_calls.load(), 0);
+}
+
+TEST(CockooTest, StoreHash) {
+  TestInsertFindErase<LpCockooHash<int, Value, StoreHashOpts<HashOpts>>>();
+  TestInsertFindErase<
+      LpCockooHash<int, Value, StoreHashOpts<WideTagResizeOpts>>>();
+  TestInsertFindErase<
+      LpCockooHash<int, Value, StoreHashOpts<InterleaveOpts<4, 8>>>>();
+
+  // Evictions read the stored hashes.
+  value_hash_calls = 0;
+  LpCockooHash<int, Value, StoreHashOpts<HashOpts>> t(1000);
+  std::mt19937 rand(0);
+  for (int i = 0; i < 1000; i++) {
+    if (t.insert(rand() % 1000000).first == t.end()) break;
+  }
+  EXPECT_EQ(value_hash_calls, 0);
+}
+
+template <typename Opts>
+void TestSingleHash() {
+  TestInsertFindErase<LpCockooHash<int, Value, Opts>>();
+
+  // The derived hashes must be independent enough to reach a high load.
+  LpCockooHash<int, Value, FixedSizeOpts<Opts>> t(10000);
+  const size_t slots = Opts::NumHashes * t.slots_per_table();
+  for (int k = 0; k < slots * 0.9; k++) {
+    ASSERT_FALSE(t.insert(k).first == t.end());
+  }
+  for (int k = 0; k < slots * 0.9; k++) ASSERT_FALSE(t.find(k) == t.end());
+}
+
+TEST(CockooTest, SingleHash) {
+  other_hash_calls = 0;
+  TestSingleHash<SingleHashOpts<2, LpCockooHashIndexMode::kModulo>>();
+  TestSingleHash<SingleHashOpts<3, LpCockooHashIndexMode::kModulo>>();
+  TestSingleHash<SingleHashOpts<3, LpCockooHashIndexMode::kMultiplyShift>>();
+  TestSingleHash<SingleHashOpts<4, LpCockooHashIndexMode::kPowerOfTwo>>();
+  EXPECT_EQ(other_hash_calls.load(), 0);
+}
+
+template <typename Opts>
+void TestConcurrentInsert() {
+  const int kWriters = 4;
+  const int kKeysPerWriter = 5000;
+  LpCockooHash<int, Value, Opts> t(4 * kWriters * kKeysPerWriter);
+
+  std::atomic<bool> failed(false);
+  std::vector<std::thread> writers;
+  for (int w = 0; w < kWriters; w++) {
+    writers.emplace_back([&, w]() {
+      std::mt19937 rand(w);
+      Value v;
+      for (int i = 0; i < kKeysPerWriter; i++) {
+        // Writers insert disjoint keys.
+        const int k = (rand() % 1000000) * kWriters + w;
+        if (t.insert(k).first == t.end()) failed = true;
+        if (!t.find(k, &v) || v.value != k + 1) failed = true;
+      }
+    });
+  }
+  for (std::thread& th : writers) th.join();
+  EXPECT_FALSE(failed.load());
+
+  for (int w = 0; w < kWriters; w++) {
+    std::mt19937 rand(w);
+    for (int i = 0; i < kKeysPerWriter; i++) {
+      const int k = (rand() % 1000000) * kWriters + w;
+      auto it = t.find(k);
+      ASSERT_FALSE(it == t.end());
+      ASSERT_EQ(it->value, k + 1);
+    }
+  }
+}
+
+TEST(CockooTest, ConcurrentInsert) {
+  TestConcurrentInsert<ConcurrentOpts>();
+  TestConcurrentInsert<ConcurrentPartialKeyOpts>();
+}
+
+TEST(CockooTest, ConcurrentErase) {
+  const int kWriters = 4;
+  const int kKeysPerWriter = 5000;
+  LpCockooHash<int, Value, ConcurrentPartialKeyOpts> t(kWriters *
+                                                       kKeysPerWriter);
+
+  // Each writer inserts its keys and erases every other one, while the
+  // other writers' inserts move elements around.
+  std::atomic<bool> failed(false);
+  std::vector<std::thread> writers;
+  for (int w = 0; w < kWriters; w++) {
+    writers.emplace_back([&, w]() {
+      for (int i = 0; i < kKeysPerWriter; i++) {
+        const int k = i * kWriters + w;
+        if (t.insert(k).first == t.end()) failed = true;
+        if (i % 2 == 1 && t.erase(k - kWriters) != 1) failed = true;
+      }
+    });
+  }
+  for (std::thread& th : writers) th.join();
+  EXPECT_FALSE(failed.load());
+  Value v;
+  for (int k = 0; k < kWriters * kKeysPerWriter; k++) {
+    EXPECT_EQ(t.find(k, &v), (k / kWriters) % 2 == 1) << k;
+  }
+}
+
+// erase_if sweeps the table while writers insert. pred must only see whole
+// elements, whose value Init set together with the key.
+TEST(CockooTest, ConcurrentEraseIf) {
+  const int kWriters = 3;
+  const int kKeysPerWriter = 5000;
+  LpCockooHash<int, Value, ConcurrentPartialKeyOpts> t(kWriters *
+                                                       kKeysPerWriter);
+  for (int k = 0; k < kKeysPerWriter; k++) {
+    ASSERT_FALSE(t.insert(k * (kWriters + 1)).first == t.end());
+  }
+
+  std::atomic<bool> failed(false);
+  std::vector<std::thread> writers;
+  for (int w = 1; w <= kWriters; w++) {
+    writers.emplace_back([&, w]() {
+      for (int i = 0; i < kKeysPerWriter; i++) {
+        if (t.insert(i * (kWriters + 1) + w).first == t.end()) failed = true;
+      }
+    });
+  }
+  std::atomic<bool> torn(false);
+  auto pred = [&](const Value& v) {
+    if (v.value != v.key + 1) torn = true;
+    return v.key % (kWriters + 1) == 0;
+  };
+  size_t erased = t.erase_if(pred);
+  for (std::thread& th : writers) th.join();
+  EXPECT_FALSE(failed.load());
+  EXPECT_FALSE(torn.load());
+  // The first sweep may miss elements that the inserts moved.
+  erased += t.erase_if(pred);
+  EXPECT_EQ(erased, static_cast<size_t>(kKeysPerWriter));
+  Value v;
+  for (int k = 0; k < (kWriters + 1) * kKeysPerWriter; k++) {
+    EXPECT_EQ(t.find(k, &v), k % (kWriters + 1) != 0) << k;
+  }
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();